@@ -17,23 +17,59 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <cfloat>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <fstream>
+#include <map>
 #include <memory>
+#include <numeric>
 #include <string>
 
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 #include "DeblockPP7.hpp"
 
 #ifdef VS_TARGET_CPU_X86
-template<typename T> extern void pp7Filter_sse2(const VSFrameRef *, VSFrameRef *, const DeblockPP7Data * const VS_RESTRICT, const VSAPI *) noexcept;
-template<typename T> extern void pp7Filter_sse4(const VSFrameRef *, VSFrameRef *, const DeblockPP7Data * const VS_RESTRICT, const VSAPI *) noexcept;
+template<typename T> extern void pp7Row_sse2(const void * const *, void * const *, const int, void *, const DeblockPP7Blocks * const VS_RESTRICT,
+                                             const DeblockPP7Data * const VS_RESTRICT) noexcept;
+template<typename T> extern void pp7Row_sse4(const void * const *, void * const *, const int, void *, const DeblockPP7Blocks * const VS_RESTRICT,
+                                             const DeblockPP7Data * const VS_RESTRICT) noexcept;
+extern void pp7RowFixed_sse2(const void * const *, void * const *, const int, void *, const DeblockPP7Blocks * const VS_RESTRICT,
+                             const DeblockPP7Data * const VS_RESTRICT) noexcept;
+extern void pp7RowFixed_sse4(const void * const *, void * const *, const int, void *, const DeblockPP7Blocks * const VS_RESTRICT,
+                             const DeblockPP7Data * const VS_RESTRICT) noexcept;
+extern void pp7PadHalf_f16c(const void *, void *, const int) noexcept;
+extern void pp7StoreHalf_f16c(const float *, void *, const int) noexcept;
 #endif
 
+/*
+ * 7-point transform with the basis rows (1 1 1 2 1 1 1), (-2 -1 1 4 1 -1 -2), (1 -1 -1 2 -1 -1 1) and (-1 2 -2 2 -2 2 -1).
+ * Neighbouring outputs share 6 of their 7 inputs, but only the first row is translation invariant, so only the DC term
+ * could be updated from the previous position by adding the entering and subtracting the leaving samples. The folded
+ * sums s0..s2 pair samples at distance 6, 4 and 2 around the centre and are never shared between two positions, so the
+ * AC terms have to be computed directly either way and a running DC would only add work.
+ */
 template<typename T, int scale>
-static inline void dctA(const T * srcp, T * VS_RESTRICT dstp, const int stride) noexcept {
+static inline void dctA(const T * const * srcp, const int x, T * VS_RESTRICT dstp, T * VS_RESTRICT lo, T * VS_RESTRICT hi) noexcept {
     for (int i = 0; i < 4; i++) {
-        T s0 = (srcp[0 * stride] + srcp[6 * stride]) * scale;
-        T s1 = (srcp[1 * stride] + srcp[5 * stride]) * scale;
-        T s2 = (srcp[2 * stride] + srcp[4 * stride]) * scale;
-        T s3 = srcp[3 * stride] * scale;
+        T minimum = srcp[0][x + i];
+        T maximum = minimum;
+        for (int j = 1; j < 7; j++) {
+            minimum = std::min(minimum, srcp[j][x + i]);
+            maximum = std::max(maximum, srcp[j][x + i]);
+        }
+        lo[i] = minimum;
+        hi[i] = maximum;
+
+        T s0 = (srcp[0][x + i] + srcp[6][x + i]) * scale;
+        T s1 = (srcp[1][x + i] + srcp[5][x + i]) * scale;
+        T s2 = (srcp[2][x + i] + srcp[4][x + i]) * scale;
+        T s3 = srcp[3][x + i] * scale;
         T s = s3 + s3;
         s3 = s - s0;
         s0 = s + s0;
@@ -44,7 +80,6 @@ static inline void dctA(const T * srcp, T * VS_RESTRICT dstp, const int stride)
         dstp[1] = 2 * s3 + s2;
         dstp[3] = s3 - 2 * s2;
 
-        srcp++;
         dstp += 4;
     }
 }
@@ -72,257 +107,1509 @@ static inline void dctB(const T * srcp, T * VS_RESTRICT dstp) noexcept {
 }
 
 template<typename T>
-static void pp7Filter_c(const VSFrameRef * src, VSFrameRef * dst, const DeblockPP7Data * const VS_RESTRICT d, const VSAPI * vsapi) noexcept {
-    const auto threadId = std::this_thread::get_id();
-    int * buffer = d->buffer.at(threadId);
+static void pp7Row_c(const void * const * rows, void * const * dstp, const int width, void * buffer, const DeblockPP7Blocks * const VS_RESTRICT b,
+                     const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    pp7Row<T, int, dctA<int, 1>, dctB<int>>(rows, dstp, width, buffer, b, d);
+}
 
-    for (int plane = 0; plane < d->vi->format->numPlanes; plane++) {
-        if (d->process[plane]) {
-            const int width = vsapi->getFrameWidth(src, plane);
-            const int height = vsapi->getFrameHeight(src, plane);
-            const int srcStride = vsapi->getStride(src, plane) / sizeof(T);
-            const int stride = d->stride[plane];
-            const T * srcp = reinterpret_cast<const T *>(vsapi->getReadPtr(src, plane));
-            T * VS_RESTRICT dstp = reinterpret_cast<T *>(vsapi->getWritePtr(dst, plane));
-
-            int * VS_RESTRICT p_src = buffer + stride * 8;
-            int * VS_RESTRICT block = buffer;
-            int * VS_RESTRICT temp = buffer + 16;
-
-            for (int y = 0; y < height; y++) {
-                const int index = stride * (8 + y) + 8;
-                std::copy_n(srcp + srcStride * y, width, p_src + index);
-                for (int x = 0; x < 8; x++) {
-                    p_src[index - 1 - x] = p_src[index + x];
-                    p_src[index + width + x] = p_src[index + width - 1 - x];
-                }
+template<>
+void pp7Row_c<float>(const void * const * rows, void * const * dstp, const int width, void * buffer, const DeblockPP7Blocks * const VS_RESTRICT b,
+                     const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    pp7Row<float, float, dctA<float, 255>, dctB<float>>(rows, dstp, width, buffer, b, d);
+}
+
+static void pp7RowFixed_c(const void * const * rows, void * const * dstp, const int width, void * buffer, const DeblockPP7Blocks * const VS_RESTRICT b,
+                          const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    pp7Row<float, int, dctA<int, 1>, dctB<int>>(rows, dstp, width, buffer, b, d);
+}
+
+/*
+ * Filters a row of half float input with the float kernel row into float rows behind the part of the scratch space the
+ * kernel uses, and rounds them to half floats with store while they are still in cache.
+ */
+template<void (*row)(const void * const *, void * const *, const int, void *, const DeblockPP7Blocks * const VS_RESTRICT, const DeblockPP7Data * const VS_RESTRICT),
+         void (*store)(const float *, void *, const int)>
+static void pp7RowHalf(const void * const * rows, void * const * dstp, const int width, void * buffer, const DeblockPP7Blocks * const VS_RESTRICT b,
+                       const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    float * filtered = static_cast<float *>(buffer) + 16 + 7 * (width + 16);
+
+    void * dst[OUTPUTS] = {};
+    for (int k = 0; k < d->outputs; k++)
+        dst[k] = filtered + width * k;
+
+    row(rows, dst, width, buffer, b, d);
+
+    for (int k = 0; k < d->outputs; k++)
+        store(filtered + width * k, dstp[k], width);
+}
+
+/*
+ * Filters a whole plane of type T whose range is at most t->flatRange into one of the output type O. No AC coefficient
+ * of any window can pass its threshold then, and the output is the DC term alone, a separable 7-tap box with the weights
+ * (1 1 1 2 1 1 1) in both directions. It is computed with running sums in O(1) per pixel and the same integer
+ * arithmetic as the transform, so the result is identical. Returns false without writing anything if the plane is not
+ * flat.
+ */
+template<typename T, typename O>
+static bool pp7Box(const uint8_t * _srcp, const int srcStride, uint8_t * _dstp, const int dstStride, const int width, const int height, int * buffer,
+                   const DeblockPP7Table * const VS_RESTRICT t, const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    const T * srcp = reinterpret_cast<const T *>(_srcp);
+    O * VS_RESTRICT dstp = reinterpret_cast<O *>(_dstp);
+    const int srcPitch = srcStride / sizeof(T);
+    const int dstPitch = dstStride / sizeof(O);
+
+    int minimum = srcp[0], maximum = srcp[0];
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            minimum = std::min<int>(minimum, srcp[srcPitch * y + x]);
+            maximum = std::max<int>(maximum, srcp[srcPitch * y + x]);
+        }
+
+        if (maximum - minimum > t->flatRange)
+            return false;
+    }
+
+    auto row = [&](int r) {
+        if (r < 0)
+            r = -1 - r;
+        else if (r >= height)
+            r = 2 * height - 1 - r;
+        return srcp + srcPitch * r;
+    };
+
+    int * VS_RESTRICT box = buffer;
+    int * VS_RESTRICT col = buffer + width + 3;
+
+    std::fill_n(box, width, 0);
+    for (int i = -3; i <= 3; i++) {
+        const T * r = row(i);
+        for (int x = 0; x < width; x++)
+            box[x] += r[x];
+    }
+
+    for (int y = 0; y < height; y++) {
+        if (y) {
+            const T * enter = row(y + 3);
+            const T * leave = row(y - 4);
+            for (int x = 0; x < width; x++)
+                box[x] += enter[x] - leave[x];
+        }
+
+        const T * centre = srcp + srcPitch * y;
+        for (int x = 0; x < width; x++)
+            col[x] = box[x] + centre[x];
+        for (int x = 0; x < 3; x++) {
+            col[-1 - x] = col[x];
+            col[width + x] = col[width - 1 - x];
+        }
+
+        int sum = col[-3] + col[-2] + col[-1] + col[0] + col[1] + col[2] + col[3];
+        for (int x = 0; x < width; x++) {
+            if (x)
+                sum += col[x + 3] - col[x - 4];
+            const int64_t v = static_cast<int64_t>(sum + col[x]) * d->factor[0];
+            dstp[x] = (d->limit < FLT_MAX) ? pp7Round<O, true>(v, centre[x], d) : pp7Round<O, false>(v, centre[x], d);
+        }
+
+        if (d->strength < 1.f)
+            pp7Strength(centre, dstp, width, d);
+
+        dstp += dstPitch;
+    }
+
+    return true;
+}
+
+/*
+ * Thresholds of row y of a plane for a span starting at pixel x0.
+ */
+static inline DeblockPP7Blocks blockRow(const DeblockPP7Blocks * b, const int y, const int x0) noexcept {
+    DeblockPP7Blocks row = *b;
+    if (row.qp)
+        row.qp += row.stride * std::min((row.top + y) >> row.shiftY, row.rows - 1);
+    row.offset = row.left + x0;
+    return row;
+}
+
+static inline bool maskZero(const uint8_t * maskp, const int bytes) noexcept {
+    for (int i = 0; i < bytes; i++) {
+        if (maskp[i])
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Filters row y only in the runs of 8 pixel chunks where the mask is not zero, and merges them with the source by the
+ * mask. The chunks in between are copied from the source, so no output pixel is ever read before it is written.
+ */
+static void filterMaskedRow(const void * const * rows, void * const * dst, const int width, const int y, void * scratch, const DeblockPP7Blocks * b,
+                            const DeblockPP7Source * source, const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    const int bytesPerSample = d->vi->format->bytesPerSample;
+    const int outBytesPerSample = d->outFormat->bytesPerSample;
+    const uint8_t * srcp = source->srcp + source->srcStride * y;
+    const uint8_t * maskp = source->maskp + source->maskStride * y;
+    const int chunks = (width + 7) >> 3;
+
+    auto copy = [&](const int x0, const int x1) {
+        for (int k = 0; k < d->outputs; k++)
+            d->pp7Convert(srcp + x0 * bytesPerSample, static_cast<uint8_t *>(dst[k]) + x0 * outBytesPerSample, x1 - x0, d);
+    };
+
+    auto active = [&](const int c) {
+        return !maskZero(maskp + c * 8 * bytesPerSample, std::min(8, width - c * 8) * bytesPerSample);
+    };
+
+    int copied = 0;
+
+    for (int c = 0; c < chunks;) {
+        if (!active(c)) {
+            c++;
+            continue;
+        }
+
+        const int first = c;
+        while (c < chunks && active(c))
+            c++;
+
+        // At speed 2 the last pixel of a chunk is interpolated from the first one of the next. That pixel is copied
+        // over again with the next inactive chunk.
+        const int x0 = first * 8;
+        const int x1 = std::min(c * 8 + (d->speed >= 2 ? 1 : 0), width);
+        const int end = std::min(c * 8, width);
+
+        copy(copied, x0);
+        copied = end;
+
+        // The widened rows hold 4 byte samples of either type.
+        const void * span[7];
+        for (int i = 0; i < 7; i++)
+            span[i] = static_cast<const int *>(rows[i]) + x0;
+
+        void * spanDst[OUTPUTS];
+        for (int k = 0; k < d->outputs; k++)
+            spanDst[k] = static_cast<uint8_t *>(dst[k]) + x0 * outBytesPerSample;
+
+        const DeblockPP7Blocks row = blockRow(b, y, x0);
+        d->pp7Row(span, spanDst, x1 - x0, scratch, &row, d);
+
+        for (int k = 0; k < d->outputs; k++)
+            d->pp7Blend(srcp + x0 * bytesPerSample, maskp + x0 * bytesPerSample, spanDst[k], end - x0, d);
+    }
+
+    copy(copied, width);
+}
+
+/*
+ * Writes the residual of row y of every output against the source row srcp to dstp[d->outputs + k].
+ */
+static void residualRow(const uint8_t * srcp, uint8_t * const * dstp, const int * dstStride, const int width, const int y,
+                        const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    for (int k = 0; k < d->outputs; k++)
+        d->pp7Residual(srcp, dstp[k] + dstStride[k] * y, dstp[d->outputs + k] + dstStride[d->outputs + k] * y, width, d);
+}
+
+/*
+ * Filters output row y of every output from a ring of ringRows widened rows, where source row r lives in slot
+ * r % ringRows and the rows above and below the plane are mirrored.
+ */
+static void filterRow(const DeblockPP7Blocks * const VS_RESTRICT b, const DeblockPP7Source * source, const DeblockPP7Data * const VS_RESTRICT d, const int * ring,
+                      const int ringRows, const int stride, const int width, const int height, const int y, void * scratch, uint8_t * const * dstp,
+                      const int * dstStride) noexcept {
+    const void * rows[7];
+    void * dst[OUTPUTS];
+
+    for (int i = 0; i < 7; i++) {
+        int row = y - 3 + i;
+        if (row < 0)
+            row = -1 - row;
+        else if (row >= height)
+            row = 2 * height - 1 - row;
+        rows[i] = ring + stride * (row % ringRows) + 8;
+    }
+
+    for (int k = 0; k < d->outputs; k++)
+        dst[k] = dstp[k] + dstStride[k] * y;
+
+    if (source->maskp) {
+        filterMaskedRow(rows, dst, width, y, scratch, b, source, d);
+    } else {
+        const DeblockPP7Blocks row = blockRow(b, y, 0);
+        d->pp7Row(rows, dst, width, scratch, &row, d);
+    }
+
+    if (d->residual)
+        residualRow(source->srcp + source->srcStride * y, dstp, dstStride, width, y, d);
+}
+
+DeblockPP7Stream::DeblockPP7Stream(const DeblockPP7Blocks * b_, const DeblockPP7Source * source_, const DeblockPP7Data * d_, const int plane, const int width_,
+                                   const int height_, void * buffer, uint8_t * const * dstp_, const int * dstStride_) noexcept :
+    b{ b_ }, source{ source_ }, d{ d_ }, width{ width_ }, height{ height_ }, stride{ d_->stride[plane] },
+    scratch{ static_cast<int *>(buffer) }, ring{ static_cast<int *>(buffer) + scratchSize(d_->stride[plane], d_) }, dstp{ dstp_ }, dstStride{ dstStride_ } {}
+
+int DeblockPP7Stream::pushRow(const void * srcp) noexcept {
+    d->pp7Pad(srcp, ring + stride * (rowsIn % RING) + 8, width);
+    rowsIn++;
+
+    for (; rowsOut + 3 < rowsIn; rowsOut++)
+        filterRow(b, source, d, ring, RING, stride, width, height, rowsOut, scratch, dstp, dstStride);
+
+    return rowsOut;
+}
+
+int DeblockPP7Stream::finish() noexcept {
+    for (; rowsOut < height; rowsOut++)
+        filterRow(b, source, d, ring, RING, stride, width, height, rowsOut, scratch, dstp, dstStride);
+
+    return rowsOut;
+}
+
+/*
+ * Groups the logical CPUs this process may run on by physical core, using the sysfs topology. Returns an empty list
+ * where that information is not available.
+ */
+static std::vector<std::vector<int>> physicalCores() {
+    std::vector<std::vector<int>> cores;
+
+#ifdef __linux__
+    cpu_set_t mask;
+    if (sched_getaffinity(0, sizeof(mask), &mask))
+        return cores;
+
+    std::map<std::pair<int, int>, std::vector<int>> byCore;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &mask))
+            continue;
+
+        const std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+        int package = -1, core = -1;
+        std::ifstream{ path + "physical_package_id" } >> package;
+        std::ifstream{ path + "core_id" } >> core;
+
+        // Without topology information every logical CPU counts as a core of its own.
+        if (core < 0)
+            package = -1 - cpu;
+        byCore[{ package, core }].push_back(cpu);
+    }
+
+    for (auto & iter : byCore)
+        cores.push_back(std::move(iter.second));
+#endif
+
+    return cores;
+}
+
+/*
+ * Order in which pool workers are placed on logical CPUs. By default the first sibling of every physical core comes
+ * first so that workers do not share a core's L1/L2 until there are more workers than cores. With smt, all siblings of
+ * a core are used before moving on to the next core.
+ */
+static std::vector<int> poolLayout(const bool smt) {
+    const auto cores = physicalCores();
+    std::vector<int> cpus;
+
+    if (smt) {
+        for (auto & core : cores)
+            cpus.insert(cpus.end(), core.begin(), core.end());
+    } else {
+        size_t siblings = 0;
+        for (auto & core : cores)
+            siblings = std::max(siblings, core.size());
+
+        for (size_t sibling = 0; sibling < siblings; sibling++) {
+            for (auto & core : cores) {
+                if (sibling < core.size())
+                    cpus.push_back(core[sibling]);
             }
-            for (int y = 0; y < 8; y++) {
-                memcpy(p_src + stride * (7 - y), p_src + stride * (8 + y), stride * sizeof(int));
-                memcpy(p_src + stride * (height + 8 + y), p_src + stride * (height + 7 - y), stride * sizeof(int));
+        }
+    }
+
+    return cpus;
+}
+
+// Position in the layout where the threads of the next filter instance with affinity are pinned, so that several
+// instances do not pile onto the same cores.
+static std::atomic<unsigned> nextCpu{ 0 };
+
+/*
+ * The logical CPUs the threads of a new pool with affinity are pinned to, one per thread, or an empty list where the
+ * topology cannot be read. With claim, the CPUs are taken and the next pool starts after them.
+ */
+static std::vector<int> poolCpus(const int threads, const bool smt, const bool claim) {
+    const auto layout = poolLayout(smt);
+    std::vector<int> cpus;
+
+    if (!layout.empty()) {
+        const unsigned first = claim ? nextCpu.fetch_add(threads) : nextCpu.load();
+        for (int i = 0; i < threads; i++)
+            cpus.push_back(layout[(first + i) % layout.size()]);
+    }
+
+    return cpus;
+}
+
+DeblockPP7Pool::DeblockPP7Pool(const int numWorkers, const std::vector<int> & cpus) {
+    for (int i = 1; i <= numWorkers; i++) {
+        workers.emplace_back(&DeblockPP7Pool::workerLoop, this, i);
+
+#ifdef __linux__
+        if (!cpus.empty()) {
+            cpu_set_t mask;
+            CPU_ZERO(&mask);
+            CPU_SET(cpus[(i - 1) % cpus.size()], &mask);
+            pthread_setaffinity_np(workers.back().native_handle(), sizeof(mask), &mask);
+        }
+#endif
+    }
+}
+
+DeblockPP7Pool::~DeblockPP7Pool() {
+    {
+        std::lock_guard<std::mutex> lock{ mutex };
+        stop = true;
+    }
+    start.notify_all();
+
+    for (auto & worker : workers)
+        worker.join();
+}
+
+bool DeblockPP7Pool::tryRun(const std::function<void()> & setup, const std::function<void(int)> & job_) {
+    std::unique_lock<std::mutex> busyLock{ busy, std::try_to_lock };
+    if (!busyLock.owns_lock())
+        return false;
+
+    setup();
+
+    {
+        std::lock_guard<std::mutex> lock{ mutex };
+        job = &job_;
+        pending = static_cast<int>(workers.size());
+        generation++;
+    }
+    start.notify_all();
+
+    job_(0);
+
+    std::unique_lock<std::mutex> lock{ mutex };
+    done.wait(lock, [&] { return pending == 0; });
+    job = nullptr;
+    return true;
+}
+
+void DeblockPP7Pool::workerLoop(const int index) {
+    unsigned seen = 0;
+
+    for (;;) {
+        const std::function<void(int)> * current;
+        {
+            std::unique_lock<std::mutex> lock{ mutex };
+            start.wait(lock, [&] { return stop || generation != seen; });
+            if (stop)
+                return;
+            seen = generation;
+            current = job;
+        }
+
+        (*current)(index);
+
+        std::lock_guard<std::mutex> lock{ mutex };
+        if (--pending == 0)
+            done.notify_one();
+    }
+}
+
+/*
+ * Two-stage pipeline over one plane. The calling thread widens source rows into a shared ring of d->ringRows rows, and
+ * every pool thread (the calling one included) filters the bands of d->band rows assigned to it round-robin. Each
+ * consumer publishes the number of bands it has finished through its own progress counter, which the producer reads to
+ * know which ring slots may be overwritten. The last counter holds the number of rows produced so far. A thread that
+ * has to wait for another polls briefly and then sleeps in the pool until that one publishes progress.
+ */
+static void pp7FilterPipelined(const uint8_t * srcp, const int srcStride, uint8_t * const * dstp, const int * dstStride, const int width, const int height,
+                               const int stride, const int index, const DeblockPP7Blocks * const VS_RESTRICT blocks, const DeblockPP7Source * source,
+                               const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    const int consumers = d->pool->size();
+    const int band = d->band;
+    const int ringRows = d->ringRows;
+    int * ring = d->pipelineBuffer;
+    void * scratch = d->pipelineBuffer + ringRows * stride + DeblockPP7Stream::scratchSize(stride, d) * index;
+    std::atomic<int> & produced = d->progress[consumers].value;
+
+    auto filterBand = [&](const int b) {
+        const int last = std::min((b + 1) * band, height);
+        for (int y = b * band; y < last; y++)
+            filterRow(blocks, source, d, ring, ringRows, stride, width, height, y, scratch, dstp, dstStride);
+        d->progress[index].value.fetch_add(1);
+        d->pool->wake();
+    };
+
+    auto bandReady = [&](const int b, const int rows) {
+        return rows >= std::min((b + 1) * band + 3, height);
+    };
+
+    int b = index;
+
+    if (index) {
+        for (; b * band < height; b += consumers) {
+            d->pool->waitFor([&] { return bandReady(b, produced.load()); });
+            filterBand(b);
+        }
+        return;
+    }
+
+    // Rows up to this one may be written into the ring without overwriting a row a consumer still needs.
+    auto writable = [&] {
+        int lowest = height;
+        for (int i = 0; i < consumers; i++)
+            lowest = std::min(lowest, (d->progress[i].value.load() * consumers + i) * band);
+        return std::min(height, lowest - 3 + ringRows);
+    };
+
+    int rows = 0;
+    while (rows < height || b * band < height) {
+        const int limit = writable();
+        if (rows < limit) {
+            for (; rows < limit; rows++) {
+                if (d->prefetch && rows + 1 < height)
+                    prefetchRow(srcp + srcStride * (rows + 1), width * d->vi->format->bytesPerSample);
+                d->pp7Pad(srcp + srcStride * rows, ring + stride * (rows % ringRows) + 8, width);
             }
+            produced.store(rows);
+            d->pool->wake();
+        }
 
-            for (int y = 0; y < height; y++) {
-                for (int x = -8; x < 0; x += 4) {
-                    const int index = (stride + 1) * (8 - 3) + stride * y + 8 + x;
-                    int * VS_RESTRICT tp = temp + 4 * x;
+        if (b * band < height && bandReady(b, rows)) {
+            filterBand(b);
+            b += consumers;
+        } else if (rows < height) {
+            // The ring is full, so wait for the slowest consumer to free a slot.
+            d->pool->waitFor([&] { return writable() > rows; });
+        }
+    }
+}
 
-                    dctA<int, 1>(p_src + index, tp + 4 * 8, stride);
-                }
+/*
+ * Bytes needed after the stream buffer for the block masks of pp7FilterTemporal.
+ */
+static int temporalSize(const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    return ((d->vi->width + 7) >> 3) * (((d->vi->height + 7) >> 3) + 1);
+}
 
-                for (int x = 0; x < width; x++) {
-                    const int index = (stride + 1) * (8 - 3) + stride * y + 8 + x;
-                    int * VS_RESTRICT tp = temp + 4 * x;
-
-                    if (!(x & 3))
-                        dctA<int, 1>(p_src + index, tp + 4 * 8, stride);
-                    dctB(tp, block);
-
-                    int64_t v = static_cast<int64_t>(block[0]) * d->factor[0];
-                    if (d->mode == 0) {
-                        for (int i = 1; i < 16; i++) {
-                            const unsigned threshold1 = d->thresh[i];
-                            const unsigned threshold2 = threshold1 * 2;
-                            if (block[i] + threshold1 > threshold2)
-                                v += static_cast<int64_t>(block[i]) * d->factor[i];
-                        }
-                    } else if (d->mode == 1) {
-                        for (int i = 1; i < 16; i++) {
-                            const unsigned threshold1 = d->thresh[i];
-                            const unsigned threshold2 = threshold1 * 2;
-                            if (block[i] + threshold1 > threshold2) {
-                                if (block[i] > 0)
-                                    v += (block[i] - static_cast<int64_t>(threshold1)) * d->factor[i];
-                                else
-                                    v += (block[i] + static_cast<int64_t>(threshold1)) * d->factor[i];
-                            }
-                        }
-                    } else {
-                        for (int i = 1; i < 16; i++) {
-                            const unsigned threshold1 = d->thresh[i];
-                            const unsigned threshold2 = threshold1 * 2;
-                            if (block[i] + threshold1 > threshold2) {
-                                if (block[i] + threshold2 > threshold2 * 2) {
-                                    v += static_cast<int64_t>(block[i]) * d->factor[i];
-                                } else {
-                                    if (block[i] > 0)
-                                        v += 2 * (block[i] - static_cast<int64_t>(threshold1)) * d->factor[i];
-                                    else
-                                        v += 2 * (block[i] + static_cast<int64_t>(threshold1)) * d->factor[i];
-                                }
-                            }
-                        }
-                    }
-                    v = (v + (1 << 17)) >> 18;
-                    if (static_cast<unsigned>(v) > d->peak)
-                        v = -v >> 63;
+/*
+ * Filters a plane from the previous source and output frames, with cachep[k] holding the previous frame of clip k.
+ * An output pixel only depends on the 7x7 source window around it, so it is copied from the previous output unless an
+ * 8x8 block that changed lies within 3 pixels. Only the
+ * spans of the remaining pixels are filtered, and only the source rows they need are widened. The residual of a row
+ * with such spans is computed again. Returns false without writing anything if every block changed.
+ */
+static bool pp7FilterTemporal(const uint8_t * srcp, const int srcStride, const uint8_t * prevp, const int prevStride, const uint8_t * const * cachep,
+                              const int * cacheStride, uint8_t * const * dstp, const int * dstStride, const int width, const int height,
+                              const int stride, int * buffer, const DeblockPP7Blocks * const VS_RESTRICT blocks, const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    const int bytesPerSample = d->vi->format->bytesPerSample;
+    const int outBytesPerSample = d->outFormat->bytesPerSample;
+    const int rowSize = width * bytesPerSample;
+    const int blocksX = (width + 7) >> 3;
+    const int blocksY = (height + 7) >> 3;
+
+    int * scratch = buffer;
+    int * ring = buffer + DeblockPP7Stream::scratchSize(stride, d);
+    uint8_t * changed = reinterpret_cast<uint8_t *>(buffer + DeblockPP7Stream::bufferSize(d->stride[0], d));
+    uint8_t * active = changed + blocksX * blocksY;
+
+    std::fill_n(changed, blocksX * blocksY, 0);
+    int numChanged = 0;
+
+    for (int y = 0; y < height; y++) {
+        const uint8_t * a = srcp + srcStride * y;
+        const uint8_t * b = prevp + prevStride * y;
+        if (!std::memcmp(a, b, rowSize))
+            continue;
+
+        uint8_t * flags = changed + blocksX * (y >> 3);
+        for (int bx = 0; bx < blocksX; bx++) {
+            const int offset = bx * 8 * bytesPerSample;
+            if (!flags[bx] && std::memcmp(a + offset, b + offset, std::min(8 * bytesPerSample, rowSize - offset))) {
+                flags[bx] = 1;
+                numChanged++;
+            }
+        }
+    }
+
+    if (numChanged == blocksX * blocksY)
+        return false;
+
+    int slotRow[RING];
+    std::fill_n(slotRow, RING, -1);
+
+    for (int y = 0; y < height; y++) {
+        for (int k = 0; k < d->clips; k++)
+            std::memcpy(dstp[k] + dstStride[k] * y, cachep[k] + cacheStride[k] * y, width * outBytesPerSample);
+
+        std::fill_n(active, blocksX, 0);
+        for (int by = std::max(y - 3, 0) >> 3; by <= std::min((y + 3) >> 3, blocksY - 1); by++) {
+            for (int bx = 0; bx < blocksX; bx++)
+                active[bx] |= changed[blocksX * by + bx];
+        }
 
-                    dstp[srcStride * y + x] = static_cast<T>(v);
+        const int * rows[7];
+        bool widened = false;
+
+        for (int bx = 0; bx < blocksX;) {
+            if (!active[bx]) {
+                bx++;
+                continue;
+            }
+
+            const int first = bx;
+            while (bx < blocksX && active[bx])
+                bx++;
+
+            if (!widened) {
+                for (int i = 0; i < 7; i++) {
+                    int row = y - 3 + i;
+                    if (row < 0)
+                        row = -1 - row;
+                    else if (row >= height)
+                        row = 2 * height - 1 - row;
+
+                    int * slot = ring + stride * (row % RING) + 8;
+                    if (slotRow[row % RING] != row) {
+                        d->pp7Pad(srcp + srcStride * row, slot, width);
+                        slotRow[row % RING] = row;
+                    }
+                    rows[i] = slot;
                 }
+                widened = true;
+
+                // The next row with changed blocks most likely needs the row below the window as well.
+                if (d->prefetch && y + 4 < height)
+                    prefetchRow(srcp + srcStride * (y + 4), rowSize);
+            }
+
+            int x0 = std::max(first * 8 - 3, 0);
+            int x1 = std::min(bx * 8 + 3, width);
+
+            // At speed 2 an interpolated pixel also depends on the windows of its neighbours, and the span has to start
+            // and end on a filtered pixel so that every pixel is computed as in a full row.
+            if (d->speed >= 2) {
+                x0 = std::max(first * 8 - 4, 0) & ~1;
+                x1 = std::min((bx * 8 + 4) | 1, width);
             }
+            const void * span[7];
+            for (int i = 0; i < 7; i++)
+                span[i] = rows[i] + x0;
+
+            void * dst[OUTPUTS];
+            for (int k = 0; k < d->outputs; k++)
+                dst[k] = dstp[k] + dstStride[k] * y + x0 * outBytesPerSample;
+
+            const DeblockPP7Blocks row = blockRow(blocks, y, x0);
+            d->pp7Row(span, dst, x1 - x0, scratch, &row, d);
         }
+
+        if (widened && d->residual)
+            residualRow(srcp + srcStride * y, dstp, dstStride, width, y, d);
     }
+
+    return true;
 }
 
-template<>
-void pp7Filter_c<float>(const VSFrameRef * src, VSFrameRef * dst, const DeblockPP7Data * const VS_RESTRICT d, const VSAPI * vsapi) noexcept {
-    const auto threadId = std::this_thread::get_id();
-    float * buffer = reinterpret_cast<float *>(d->buffer.at(threadId));
+/*
+ * Calls f(y, first, last) for the spans first..last-1 of every row of a plane that lie outside the rectangle left..right-1, top..bottom-1.
+ */
+template<typename F>
+static void forEachOutside(const int width, const int height, const int left, const int top, const int right, const int bottom, F f) noexcept {
+    for (int y = 0; y < height; y++) {
+        if (y < top || y >= bottom) {
+            f(y, 0, width);
+        } else {
+            if (left)
+                f(y, 0, left);
+            if (right < width)
+                f(y, right, width);
+        }
+    }
+}
+
+/*
+ * Filters count frames of identical geometry back to back, frame i with the thresholds of tables[i] or, if maps[i] is
+ * set, of the qp map it holds, and merged with the source by masks[i] if that is set. dst and prevDst hold d->clips
+ * frames per source frame, one for each qp followed by their residuals if d->residual is set. Planes are the outer loop, so the per-plane setup is done once and the scratch rows and threshold tables
+ * stay in cache across the frames of a batch.
+ *
+ * Only the region of interest is filtered, together with the pixels it depends on, and everything around it is
+ * copied from the source. Planes that are not processed have a residual of zero. With an output depth above that of
+ * the source, copied pixels are shifted up to it, and planes that are not processed are converted here rather than
+ * taken from the source frame.
+ */
+static void pp7Filter(const VSFrameRef * const * src, VSFrameRef * const * dst, const VSFrameRef * const * prevSrc, const VSFrameRef * const * prevDst,
+                      const DeblockPP7Table * const * tables, const VSFrameRef * const * maps, const VSFrameRef * const * masks, const int count, int * buffer,
+                      const DeblockPP7Data * const VS_RESTRICT d, const VSAPI * vsapi) noexcept {
+    const int bytesPerSample = d->vi->format->bytesPerSample;
+    const int outBytesPerSample = d->outFormat->bytesPerSample;
+    const bool converted = d->outFormat != d->vi->format;
 
     for (int plane = 0; plane < d->vi->format->numPlanes; plane++) {
         if (d->process[plane]) {
-            const int width = vsapi->getFrameWidth(src, plane);
-            const int height = vsapi->getFrameHeight(src, plane);
-            const int srcStride = vsapi->getStride(src, plane) / sizeof(float);
+            const int planeWidth = vsapi->getFrameWidth(src[0], plane);
+            const int planeHeight = vsapi->getFrameHeight(src[0], plane);
             const int stride = d->stride[plane];
-            const float * srcp = reinterpret_cast<const float *>(vsapi->getReadPtr(src, plane));
-            float * VS_RESTRICT dstp = reinterpret_cast<float *>(vsapi->getWritePtr(dst, plane));
-
-            float * VS_RESTRICT p_src = buffer + stride * 8;
-            float * VS_RESTRICT block = buffer;
-            float * VS_RESTRICT temp = buffer + 16;
-
-            for (int y = 0; y < height; y++) {
-                const int index = stride * (8 + y) + 8;
-                std::copy_n(srcp + srcStride * y, width, p_src + index);
-                for (int x = 0; x < 8; x++) {
-                    p_src[index - 1 - x] = p_src[index + x];
-                    p_src[index + width + x] = p_src[index + width - 1 - x];
+
+            const int subSamplingW = plane ? d->vi->format->subSamplingW : 0;
+            const int subSamplingH = plane ? d->vi->format->subSamplingH : 0;
+            const int left = d->left >> subSamplingW;
+            const int top = d->top >> subSamplingH;
+            const int right = d->right ? d->right >> subSamplingW : planeWidth;
+            const int bottom = d->bottom ? d->bottom >> subSamplingH : planeHeight;
+
+            // The transform window reaches 3 pixels out, and at speed 2 a pixel is interpolated from the corrections of
+            // its neighbours. The region starts on an even column, so that the same pixels are interpolated as in the
+            // whole plane.
+            const int x0 = std::max(left - 4, 0) & ~1;
+            const int y0 = std::max(top - 3, 0);
+            const int width = std::min(right + 4, planeWidth) - x0;
+            const int height = std::min(bottom + 3, planeHeight) - y0;
+            const int rowSize = width * bytesPerSample;
+            const int offset = x0 * bytesPerSample;
+            const int dstOffset = x0 * outBytesPerSample;
+
+            for (int i = 0; i < count; i++) {
+                DeblockPP7Blocks b{ tables[i], nullptr, 0, 0, 0, 0, 0, x0, y0, 0 };
+                if (maps[i]) {
+                    b.qp = vsapi->getReadPtr(maps[i], 0);
+                    b.stride = vsapi->getStride(maps[i], 0);
+                    b.columns = vsapi->getFrameWidth(maps[i], 0);
+                    b.rows = vsapi->getFrameHeight(maps[i], 0);
+                    b.shiftX = d->qpShift - subSamplingW;
+                    b.shiftY = d->qpShift - subSamplingH;
+                    b.table = d->mapTable[std::min<int>(b.qp[0], 63)].get();
+
+                    // A plane is only flat for all its blocks below the lowest limit of the map.
+                    for (int y = 0; y < b.rows; y++) {
+                        for (int x = 0; x < b.columns; x++) {
+                            const DeblockPP7Table * t = d->mapTable[std::min<int>(b.qp[b.stride * y + x], 63)].get();
+                            if (t->flatRange < b.table->flatRange)
+                                b.table = t;
+                        }
+                    }
+                }
+
+                const int srcStride = vsapi->getStride(src[i], plane);
+                const uint8_t * srcp = vsapi->getReadPtr(src[i], plane) + srcStride * y0 + offset;
+                DeblockPP7Source source{ srcp, nullptr, srcStride, 0 };
+                if (masks[i]) {
+                    source.maskStride = vsapi->getStride(masks[i], plane);
+                    source.maskp = vsapi->getReadPtr(masks[i], plane) + source.maskStride * y0 + offset;
                 }
-            }
-            for (int y = 0; y < 8; y++) {
-                memcpy(p_src + stride * (7 - y), p_src + stride * (8 + y), stride * sizeof(float));
-                memcpy(p_src + stride * (height + 8 + y), p_src + stride * (height + 7 - y), stride * sizeof(float));
-            }
 
-            for (int y = 0; y < height; y++) {
-                for (int x = -8; x < 0; x += 4) {
-                    const int index = (stride + 1) * (8 - 3) + stride * y + 8 + x;
-                    float * VS_RESTRICT tp = temp + 4 * x;
+                int dstStride[2 * OUTPUTS];
+                uint8_t * dstp[2 * OUTPUTS];
 
-                    dctA<float, 255>(p_src + index, tp + 4 * 8, stride);
+                for (int k = 0; k < d->clips; k++) {
+                    dstStride[k] = vsapi->getStride(dst[d->clips * i + k], plane);
+                    dstp[k] = vsapi->getWritePtr(dst[d->clips * i + k], plane) + dstStride[k] * y0 + dstOffset;
                 }
 
-                for (int x = 0; x < width; x++) {
-                    const int index = (stride + 1) * (8 - 3) + stride * y + 8 + x;
-                    float * VS_RESTRICT tp = temp + 4 * x;
-
-                    if (!(x & 3))
-                        dctA<float, 255>(p_src + index, tp + 4 * 8, stride);
-                    dctB(tp, block);
-
-                    float v = block[0] * d->factor[0];
-                    if (d->mode == 0) {
-                        for (int i = 1; i < 16; i++) {
-                            const unsigned threshold1 = d->thresh[i];
-                            const unsigned threshold2 = threshold1 * 2;
-                            if (static_cast<unsigned>(block[i]) + threshold1 > threshold2)
-                                v += block[i] * d->factor[i];
+                const auto filterRegion = [&] {
+                    if (prevSrc[i] && prevDst[d->clips * i]) {
+                        int cacheStride[2 * OUTPUTS];
+                        const uint8_t * cachep[2 * OUTPUTS];
+
+                        for (int k = 0; k < d->clips; k++) {
+                            cacheStride[k] = vsapi->getStride(prevDst[d->clips * i + k], plane);
+                            cachep[k] = vsapi->getReadPtr(prevDst[d->clips * i + k], plane) + cacheStride[k] * y0 + dstOffset;
                         }
-                    } else if (d->mode == 1) {
-                        for (int i = 1; i < 16; i++) {
-                            const unsigned threshold1 = d->thresh[i];
-                            const unsigned threshold2 = threshold1 * 2;
-                            if (static_cast<unsigned>(block[i]) + threshold1 > threshold2) {
-                                if (block[i] > 0.f)
-                                    v += (block[i] - threshold1) * d->factor[i];
-                                else
-                                    v += (block[i] + threshold1) * d->factor[i];
+
+                        const int prevStride = vsapi->getStride(prevSrc[i], plane);
+                        if (pp7FilterTemporal(srcp, srcStride, vsapi->getReadPtr(prevSrc[i], plane) + prevStride * y0 + offset, prevStride, cachep,
+                                              cacheStride, dstp, dstStride, width, height, stride, buffer, &b, d))
+                            return;
+                    }
+
+                    // A flat plane gives the same box for every qp. At speed 2 the box would be exact at the interpolated
+                    // pixels too, so the output of one qp would depend on the others, and the plane is filtered as usual.
+                    if (d->pp7Box && d->speed < 2 && d->pp7Box(srcp, srcStride, dstp[0], dstStride[0], width, height, buffer, b.table, d)) {
+                        for (int k = 1; k < d->outputs; k++)
+                            vs_bitblt(dstp[k], dstStride[k], dstp[0], dstStride[0], width * outBytesPerSample, height);
+
+                        if (source.maskp) {
+                            for (int k = 0; k < d->outputs; k++) {
+                                for (int y = 0; y < height; y++)
+                                    d->pp7Blend(srcp + srcStride * y, source.maskp + source.maskStride * y, dstp[k] + dstStride[k] * y, width, d);
                             }
                         }
-                    } else {
-                        for (int i = 1; i < 16; i++) {
-                            const unsigned threshold1 = d->thresh[i];
-                            const unsigned threshold2 = threshold1 * 2;
-                            if (static_cast<unsigned>(block[i]) + threshold1 > threshold2) {
-                                if (static_cast<unsigned>(block[i]) + threshold2 > threshold2 * 2) {
-                                    v += block[i] * d->factor[i];
-                                } else {
-                                    if (block[i] > 0.f)
-                                        v += 2.f * (block[i] - threshold1) * d->factor[i];
-                                    else
-                                        v += 2.f * (block[i] + threshold1) * d->factor[i];
-                                }
-                            }
+
+                        if (d->residual) {
+                            for (int y = 0; y < height; y++)
+                                residualRow(srcp + srcStride * y, dstp, dstStride, width, y, d);
                         }
+                        return;
+                    }
+
+                    if (d->pool) {
+                        auto setup = [&] {
+                            for (int j = 0; j <= d->pool->size(); j++)
+                                d->progress[j].value.store(0, std::memory_order_relaxed);
+                        };
+
+                        if (d->pool->tryRun(setup, [&](const int index) {
+                            pp7FilterPipelined(srcp, srcStride, dstp, dstStride, width, height, stride, index, &b, &source, d);
+                        }))
+                            return;
                     }
 
-                    dstp[srcStride * y + x] = v * ((1.f / (1 << 18)) * (1.f / 255.f));
+                    DeblockPP7Stream stream{ &b, &source, d, plane, width, height, buffer, dstp, dstStride };
+
+                    for (int y = 0; y < height; y++) {
+                        // The next row is read right after this push has filtered a full row, so fetch it in the meantime.
+                        if (d->prefetch && y + 1 < height)
+                            prefetchRow(srcp + srcStride * (y + 1), rowSize);
+                        stream.pushRow(srcp + srcStride * y);
+                    }
+                    stream.finish();
+                };
+
+                filterRegion();
+
+                if (left || top || right < planeWidth || bottom < planeHeight) {
+                    const uint8_t * planeSrcp = vsapi->getReadPtr(src[i], plane);
+
+                    for (int k = 0; k < d->clips; k++) {
+                        uint8_t * planeDstp = vsapi->getWritePtr(dst[d->clips * i + k], plane);
+                        // The residual is taken against the pixels just copied to its output.
+                        const uint8_t * planeOutp = (k < d->outputs) ? nullptr : vsapi->getReadPtr(dst[d->clips * i + k - d->outputs], plane);
+
+                        forEachOutside(planeWidth, planeHeight, left, top, right, bottom, [&](const int y, const int first, const int last) {
+                            const uint8_t * s = planeSrcp + srcStride * y + first * bytesPerSample;
+                            uint8_t * t = planeDstp + dstStride[k] * y + first * outBytesPerSample;
+                            if (k >= d->outputs)
+                                d->pp7Residual(s, planeOutp + dstStride[k - d->outputs] * y + first * outBytesPerSample, t, last - first, d);
+                            else if (converted)
+                                d->pp7Convert(s, t, last - first, d);
+                            else
+                                std::memcpy(t, s, (last - first) * bytesPerSample);
+                        });
+                    }
+                }
+            }
+        } else if (d->residual || converted) {
+            for (int i = 0; i < count; i++) {
+                const int planeWidth = vsapi->getFrameWidth(src[i], plane);
+                const int planeHeight = vsapi->getFrameHeight(src[i], plane);
+                const int srcStride = vsapi->getStride(src[i], plane);
+                const uint8_t * srcp = vsapi->getReadPtr(src[i], plane);
+
+                for (int k = converted ? 0 : d->outputs; k < d->clips; k++) {
+                    const int dstStride = vsapi->getStride(dst[d->clips * i + k], plane);
+                    uint8_t * dstp = vsapi->getWritePtr(dst[d->clips * i + k], plane);
+
+                    if (k >= d->outputs) {
+                        // Without conversion the output plane is the one of the source frame.
+                        const VSFrameRef * out = dst[d->clips * i + k - d->outputs];
+                        const int outStride = vsapi->getStride(out, plane);
+                        const uint8_t * outp = vsapi->getReadPtr(out, plane);
+
+                        for (int y = 0; y < planeHeight; y++)
+                            d->pp7Residual(srcp + srcStride * y, outp + outStride * y, dstp + dstStride * y, planeWidth, d);
+                    } else {
+                        for (int y = 0; y < planeHeight; y++)
+                            d->pp7Convert(srcp + srcStride * y, dstp + dstStride * y, planeWidth, d);
+                    }
                 }
             }
         }
     }
 }
 
+/*
+ * 64-bit hash of all planes of a frame in the style of xxHash64. Four independent lanes consume 32 bytes at a time so
+ * that the multiplies overlap, and the bytes at the end of each row go through a separate lane.
+ */
+static uint64_t hashFrame(const VSFrameRef * frame, const DeblockPP7Data * const VS_RESTRICT d, const VSAPI * vsapi) noexcept {
+    constexpr uint64_t prime1 = 11400714785074694791ULL;
+    constexpr uint64_t prime2 = 14029467366897019727ULL;
+    constexpr uint64_t prime3 = 1609587929392839161ULL;
+    constexpr uint64_t prime4 = 9650029242287828579ULL;
+    constexpr uint64_t prime5 = 2870177450012600261ULL;
+
+    auto rotl = [](const uint64_t v, const int r) { return (v << r) | (v >> (64 - r)); };
+    auto mix = [&](const uint64_t acc, const uint64_t input) { return rotl(acc + input * prime2, 31) * prime1; };
+
+    uint64_t lane[4] = { prime1 + prime2, prime2, 0, 0 - prime1 };
+    uint64_t tail = prime5;
+
+    for (int plane = 0; plane < d->vi->format->numPlanes; plane++) {
+        const int rowSize = vsapi->getFrameWidth(frame, plane) * d->vi->format->bytesPerSample;
+        const int height = vsapi->getFrameHeight(frame, plane);
+        const int stride = vsapi->getStride(frame, plane);
+        const uint8_t * srcp = vsapi->getReadPtr(frame, plane);
+
+        for (int y = 0; y < height; y++) {
+            int x = 0;
+            for (; x + 32 <= rowSize; x += 32) {
+                uint64_t word[4];
+                std::memcpy(word, srcp + x, sizeof(word));
+                for (int i = 0; i < 4; i++)
+                    lane[i] = mix(lane[i], word[i]);
+            }
+            for (; x < rowSize; x++)
+                tail = rotl(tail ^ (srcp[x] * prime5), 11) * prime1;
+
+            srcp += stride;
+        }
+    }
+
+    uint64_t hash = rotl(lane[0], 1) + rotl(lane[1], 7) + rotl(lane[2], 12) + rotl(lane[3], 18);
+    for (int i = 0; i < 4; i++)
+        hash = (hash ^ mix(0, lane[i])) * prime1 + prime4;
+    hash ^= tail;
+
+    hash ^= hash >> 33;
+    hash *= prime2;
+    hash ^= hash >> 29;
+    hash *= prime3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+static bool sameFrame(const VSFrameRef * a, const VSFrameRef * b, const DeblockPP7Data * const VS_RESTRICT d, const VSAPI * vsapi) noexcept {
+    for (int plane = 0; plane < d->vi->format->numPlanes; plane++) {
+        const int rowSize = vsapi->getFrameWidth(a, plane) * d->vi->format->bytesPerSample;
+        const int height = vsapi->getFrameHeight(a, plane);
+        const int strideA = vsapi->getStride(a, plane);
+        const int strideB = vsapi->getStride(b, plane);
+        const uint8_t * srcpA = vsapi->getReadPtr(a, plane);
+        const uint8_t * srcpB = vsapi->getReadPtr(b, plane);
+
+        for (int y = 0; y < height; y++) {
+            if (std::memcmp(srcpA + strideA * y, srcpB + strideB * y, rowSize))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Sets dst[k] to a new frame with the planes of clip k kept for a source identical to src and filtered with the same
+ * qp, and the properties of src, for every clip, and returns whether there was one.
+ */
+static bool findDuplicate(const uint64_t hash, const double qp, const VSFrameRef * src, VSFrameRef ** dst, DeblockPP7Data * d, VSCore * core,
+                          const VSAPI * vsapi) {
+    const VSFrameRef * cachedSrc = nullptr;
+    const VSFrameRef * cachedDst[2 * OUTPUTS];
+
+    {
+        std::lock_guard<std::mutex> lock{ d->duplicateLock };
+
+        for (auto iter = d->duplicates.begin(); iter != d->duplicates.end(); ++iter) {
+            if (iter->hash == hash && iter->qp == qp) {
+                cachedSrc = vsapi->cloneFrameRef(iter->src);
+                for (int k = 0; k < d->clips; k++)
+                    cachedDst[k] = vsapi->cloneFrameRef(iter->dst[k]);
+                d->duplicates.splice(d->duplicates.begin(), d->duplicates, iter);
+                break;
+            }
+        }
+    }
+
+    if (!cachedSrc)
+        return false;
+
+    // A matching hash is only a candidate; the frames themselves decide.
+    const bool found = sameFrame(src, cachedSrc, d, vsapi);
+    for (int k = 0; k < d->clips; k++) {
+        if (found) {
+            const VSFrameRef * fr[] = { cachedDst[k], cachedDst[k], cachedDst[k] };
+            const int pl[] = { 0, 1, 2 };
+            dst[k] = vsapi->newVideoFrame2(d->outFormat, d->vi->width, d->vi->height, fr, pl, src, core);
+        }
+        vsapi->freeFrame(cachedDst[k]);
+    }
+
+    vsapi->freeFrame(cachedSrc);
+    return found;
+}
+
+static void rememberFrame(const uint64_t hash, const double qp, const VSFrameRef * src, VSFrameRef * const * dst, DeblockPP7Data * d, const VSAPI * vsapi) {
+    std::lock_guard<std::mutex> lock{ d->duplicateLock };
+
+    DeblockPP7Duplicate entry{ hash, qp, vsapi->cloneFrameRef(src), {} };
+    for (int k = 0; k < d->clips; k++)
+        entry.dst[k] = vsapi->cloneFrameRef(dst[k]);
+    d->duplicates.push_front(entry);
+
+    while (static_cast<int>(d->duplicates.size()) > d->dedup) {
+        vsapi->freeFrame(d->duplicates.back().src);
+        for (int k = 0; k < d->clips; k++)
+            vsapi->freeFrame(d->duplicates.back().dst[k]);
+        d->duplicates.pop_back();
+    }
+}
+
+static int * getBuffer(DeblockPP7Data * d) {
+    const auto threadId = std::this_thread::get_id();
+    std::lock_guard<std::mutex> lock{ d->bufferLock };
+
+    auto iter = d->buffer.find(threadId);
+    if (iter != d->buffer.end())
+        return iter->second;
+
+    const size_t size = DeblockPP7Stream::bufferSize(d->stride[0], d) * sizeof(int) + (d->temporal ? temporalSize(d) : 0);
+    int * buffer = reinterpret_cast<int *>(vs_aligned_malloc(size, 16));
+    if (!buffer)
+        throw std::string{ "malloc failure (buffer)" };
+    d->buffer.emplace(threadId, buffer);
+    return buffer;
+}
+
+static int thresholded(const int b, const int t, const int mode) noexcept {
+    if (b >= -t && b <= t)
+        return 0;
+    if (mode == 0 || (mode == 2 && (b > 2 * t || b < -2 * t)))
+        return b;
+    return (mode == 2 ? 2 : 1) * (b > 0 ? b - t : b + t);
+}
+
+/*
+ * Builds the tables of pp7ThresholdLut for the thresholds of s and the given mode. Past 2 * thresh + 1 every mode
+ * continues with slope 1, so that is where a table ends. Coefficients with equal thresholds share one.
+ */
+static void buildLut(DeblockPP7Strength * s, const int mode) {
+    size_t size = 0;
+    for (int i = 1; i < 16; i++) {
+        if (std::find(s->thresh + 1, s->thresh + i, s->thresh[i]) == s->thresh + i)
+            size += 4 * s->thresh[i] + 3;
+    }
+    s->lutTable.reset(new int[size]);
+
+    int * table = s->lutTable.get();
+    for (int i = 1; i < 16; i++) {
+        const int t = s->thresh[i];
+        s->lutLimit[i] = 2 * t + 1;
+
+        const int j = static_cast<int>(std::find(s->thresh + 1, s->thresh + i, s->thresh[i]) - s->thresh);
+        if (j < i) {
+            s->lut[i] = s->lut[j];
+            continue;
+        }
+
+        int * center = table + s->lutLimit[i];
+        for (int b = -s->lutLimit[i]; b <= s->lutLimit[i]; b++)
+            center[b] = thresholded(b, t, mode);
+        s->lut[i] = center;
+        table += 2 * s->lutLimit[i] + 1;
+    }
+}
+
+/*
+ * Times the row kernel with and without the tables on synthetic 8 bit rows, and reports whether the tables were faster
+ * on this CPU. The rows hold blocks of random levels with noise around the thresholds, and every run filters distinct
+ * rows so that the branch predictor cannot learn them.
+ */
+static bool lutFaster(DeblockPP7Data * d) {
+    DeblockPP7Table * t = d->table.get();
+    const int width = 256;
+    const int height = 64;
+    const int stride = width + 16;
+    const int amplitude = std::min(t->flatRange * 2 + 16, 64);
+
+    unsigned seed = 1;
+    auto random = [&](const int range) {
+        seed = seed * 1103515245 + 12345;
+        return static_cast<int>((seed >> 16) % range);
+    };
+
+    std::vector<int> samples((height + 6) * stride);
+    const int blocks = (stride >> 3) + 1;
+    std::vector<int> levels(((height + 6 + 7) >> 3) * blocks);
+    for (auto & level : levels)
+        level = 64 + random(128);
+    for (int y = 0; y < height + 6; y++) {
+        for (int x = 0; x < stride; x++)
+            samples[stride * y + x] = levels[blocks * (y >> 3) + (x >> 3)] + random(2 * amplitude + 1) - amplitude;
+    }
+
+    const int rowSize = width * d->outFormat->bytesPerSample;
+    std::vector<uint8_t> dstp(rowSize * d->outputs);
+    void * dst[OUTPUTS];
+    for (int k = 0; k < d->outputs; k++)
+        dst[k] = dstp.data() + rowSize * k;
+
+    int * scratch = reinterpret_cast<int *>(vs_aligned_malloc(DeblockPP7Stream::scratchSize(stride, d) * sizeof(int), 16));
+    if (!scratch)
+        throw std::string{ "malloc failure (scratch)" };
+
+    const int * lut[OUTPUTS];
+    for (int k = 0; k < d->outputs; k++)
+        lut[k] = t->strength[k].lut[1];
+
+    const DeblockPP7Blocks b{ t, nullptr, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+    auto run = [&](const bool table) {
+        for (int k = 0; k < d->outputs; k++)
+            t->strength[k].lut[1] = table ? lut[k] : nullptr;
+        const auto start = std::chrono::steady_clock::now();
+        for (int y = 0; y < height; y++) {
+            const void * rows[7];
+            for (int i = 0; i < 7; i++)
+                rows[i] = samples.data() + stride * (y + i) + 8;
+            d->pp7Row(rows, dst, width, scratch, &b, d);
+        }
+        return std::chrono::steady_clock::now() - start;
+    };
+
+    auto arithmetic = run(false), table = run(true);
+    for (int i = 0; i < 2; i++) {
+        arithmetic = std::min(arithmetic, run(false));
+        table = std::min(table, run(true));
+    }
+
+    for (int k = 0; k < d->outputs; k++)
+        t->strength[k].lut[1] = lut[k];
+    vs_aligned_free(scratch);
+    return table < arithmetic;
+}
+
+/*
+ * Derives the thresholds and flat limits of every output from qp[0..d->outputs-1], with the tables of pp7ThresholdLut if
+ * d->lut is set.
+ */
+static std::shared_ptr<DeblockPP7Table> buildTable(const double * qp, const DeblockPP7Data * d) {
+    std::shared_ptr<DeblockPP7Table> t{ new DeblockPP7Table{} };
+
+    // Strengths are sorted by qp, so that the windows that are flat for some of them are flat for a trailing run.
+    int order[OUTPUTS];
+    std::iota(order, order + d->outputs, 0);
+    std::stable_sort(order, order + d->outputs, [&](const int a, const int b) { return qp[a] < qp[b]; });
+
+    for (int k = 0; k < d->outputs; k++) {
+        t->strength[k].output = order[k];
+        for (int i = 0; i < 16; i++)
+            t->strength[k].thresh[i] = static_cast<unsigned>((((i & 1) ? SN2 : SN0) * ((i & 4) ? SN2 : SN0) * qp[order[k]] * (1 << 2) - 1) * d->peak / 255.);
+    }
+
+    // L1 norms of the basis functions of the 7-point transform. Coefficient i uses the horizontal function i >> 2 and
+    // the vertical function i & 3, and the float kernels scale samples by 255 before transforming them.
+    //
+    // No coefficient is pruned for the whole clip: even at qp 63 the largest threshold is below 10 * peak, while a
+    // full-range window can reach at least 32 * peak on every AC coefficient. Thresholds and norms only depend on
+    // bits 0 and 2 of i, and the resulting range limits of the three classes lie within about 11% of each other, so
+    // pruning classes per window mostly adds mispredicted branches. Only the lowest limit, over all qp values, is used.
+    const int norm[] = { 8, 12, 8, 12 };
+
+    t->flatRange = INT_MAX;
+    t->flatRangeF = FLT_MAX;
+    for (int k = 0; k < d->outputs; k++) {
+        DeblockPP7Strength * s = t->strength + k;
+        s->flatRange = INT_MAX;
+        s->flatRangeF = FLT_MAX;
+        for (int i = 1; i < 16; i++) {
+            const int gain = norm[i >> 2] * norm[i & 3];
+            s->flatRange = std::min(s->flatRange, static_cast<int>(2 * s->thresh[i] / gain));
+            s->flatRangeF = std::min(s->flatRangeF, 2.f * s->thresh[i] / (gain * 255.f));
+        }
+        t->flatRange = std::min(t->flatRange, s->flatRange);
+        t->flatRangeF = std::min(t->flatRangeF, s->flatRangeF);
+    }
+
+    if (d->lut) {
+        for (int k = 0; k < d->outputs; k++)
+            buildLut(t->strength + k, d->mode);
+    }
+
+    return t;
+}
+
+/*
+ * qp of a frame taken from the property d->qpProp, clamped to the valid range, or 0 if there is none and the qp argument
+ * applies.
+ */
+static double frameQp(const VSFrameRef * frame, const DeblockPP7Data * d, const VSAPI * vsapi) noexcept {
+    if (d->qpProp.empty())
+        return 0.;
+
+    const VSMap * props = vsapi->getFramePropsRO(frame);
+    int err;
+    double qp = vsapi->propGetFloat(props, d->qpProp.c_str(), 0, &err);
+    if (err) {
+        qp = static_cast<double>(vsapi->propGetInt(props, d->qpProp.c_str(), 0, &err));
+        if (err)
+            return 0.;
+    }
+
+    return std::min(std::max(qp, 1.), 63.);
+}
+
+/*
+ * Table for a qp returned by frameQp. Tables of recent per-frame qp values are kept in a small cache shared by all
+ * threads, so a table is only built the first time its qp shows up; frames still being filtered keep theirs alive when
+ * it is evicted.
+ */
+static std::shared_ptr<const DeblockPP7Table> frameTable(const double qp, DeblockPP7Data * d) {
+    if (qp == 0.)
+        return d->table;
+
+    std::lock_guard<std::mutex> lock{ d->tableLock };
+
+    for (auto iter = d->tables.begin(); iter != d->tables.end(); ++iter) {
+        if (iter->first == qp) {
+            d->tables.splice(d->tables.begin(), d->tables, iter);
+            return iter->second;
+        }
+    }
+
+    d->tables.emplace_front(qp, buildTable(&qp, d));
+    if (d->tables.size() > 16)
+        d->tables.pop_back();
+    return d->tables.front().second;
+}
+
 static void selectFunctions(const unsigned opt, DeblockPP7Data * d) noexcept {
 #ifdef VS_TARGET_CPU_X86
     const int iset = instrset_detect();
 #endif
 
-    if (d->vi->format->bytesPerSample == 1) {
-        d->pp7Filter = pp7Filter_c<uint8_t>;
+    if (d->half) {
+        // Half floats are converted on load and store and filtered with the float kernel.
+        d->pp7Pad = pp7PadHalf;
+        d->pp7Row = pp7RowHalf<pp7Row_c<float>, pp7StoreHalf>;
+        d->pp7Blend = pp7BlendHalf;
+        d->pp7Residual = pp7ResidualHalf;
+        d->pp7Convert = pp7Convert<uint16_t, uint16_t>;
+
+#ifdef VS_TARGET_CPU_X86
+        if (opt == 0 && iset >= 5 && hasF16C()) {
+            d->pp7Pad = pp7PadHalf_f16c;
+            d->pp7Row = pp7RowHalf<pp7Row_sse4<float>, pp7StoreHalf_f16c>;
+        } else if ((opt == 0 && iset >= 5) || opt == 3) {
+            d->pp7Row = pp7RowHalf<pp7Row_sse4<float>, pp7StoreHalf>;
+        } else if ((opt == 0 && iset >= 2) || opt == 2) {
+            d->pp7Row = pp7RowHalf<pp7Row_sse2<float>, pp7StoreHalf>;
+        }
+#endif
+    } else if (d->vi->format->bytesPerSample == 1 && d->outFormat->bytesPerSample == 1) {
+        d->pp7Pad = pp7Pad<uint8_t, int>;
+        d->pp7Row = pp7Row_c<uint8_t>;
+        d->pp7Blend = pp7Blend<uint8_t, uint8_t>;
+        d->pp7Residual = pp7Residual<uint8_t, uint8_t>;
+        d->pp7Convert = pp7Convert<uint8_t, uint8_t>;
+        d->pp7Box = pp7Box<uint8_t, uint8_t>;
+
+#ifdef VS_TARGET_CPU_X86
+        if ((opt == 0 && iset >= 5) || opt == 3)
+            d->pp7Row = pp7Row_sse4<uint8_t>;
+        else if ((opt == 0 && iset >= 2) || opt == 2)
+            d->pp7Row = pp7Row_sse2<uint8_t>;
+#endif
+    } else if (d->vi->format->bytesPerSample == 1) {
+        // 8 bit input with a deeper output only differs in the store.
+        d->pp7Pad = pp7Pad<uint8_t, int>;
+        d->pp7Row = pp7Row_c<uint16_t>;
+        d->pp7Blend = pp7Blend<uint8_t, uint16_t>;
+        d->pp7Residual = pp7Residual<uint8_t, uint16_t>;
+        d->pp7Convert = pp7Convert<uint8_t, uint16_t>;
+        d->pp7Box = pp7Box<uint8_t, uint16_t>;
 
 #ifdef VS_TARGET_CPU_X86
         if ((opt == 0 && iset >= 5) || opt == 3)
-            d->pp7Filter = pp7Filter_sse4<uint8_t>;
+            d->pp7Row = pp7Row_sse4<uint16_t>;
         else if ((opt == 0 && iset >= 2) || opt == 2)
-            d->pp7Filter = pp7Filter_sse2<uint8_t>;
+            d->pp7Row = pp7Row_sse2<uint16_t>;
 #endif
     } else if (d->vi->format->bytesPerSample == 2) {
-        d->pp7Filter = pp7Filter_c<uint16_t>;
+        d->pp7Pad = pp7Pad<uint16_t, int>;
+        d->pp7Row = pp7Row_c<uint16_t>;
+        d->pp7Blend = pp7Blend<uint16_t, uint16_t>;
+        d->pp7Residual = pp7Residual<uint16_t, uint16_t>;
+        d->pp7Convert = pp7Convert<uint16_t, uint16_t>;
+        d->pp7Box = pp7Box<uint16_t, uint16_t>;
+
+#ifdef VS_TARGET_CPU_X86
+        if ((opt == 0 && iset >= 5) || opt == 3)
+            d->pp7Row = pp7Row_sse4<uint16_t>;
+        else if ((opt == 0 && iset >= 2) || opt == 2)
+            d->pp7Row = pp7Row_sse2<uint16_t>;
+#endif
+    } else if (d->fixed) {
+        d->pp7Pad = pp7PadFixed;
+        d->pp7Blend = pp7Blend<float, float>;
+        d->pp7Residual = pp7Residual<float, float>;
+        d->pp7Convert = pp7Convert<float, float>;
+        d->pp7Row = pp7RowFixed_c;
 
 #ifdef VS_TARGET_CPU_X86
         if ((opt == 0 && iset >= 5) || opt == 3)
-            d->pp7Filter = pp7Filter_sse4<uint16_t>;
+            d->pp7Row = pp7RowFixed_sse4;
         else if ((opt == 0 && iset >= 2) || opt == 2)
-            d->pp7Filter = pp7Filter_sse2<uint16_t>;
+            d->pp7Row = pp7RowFixed_sse2;
 #endif
     } else {
-        d->pp7Filter = pp7Filter_c<float>;
+        d->pp7Pad = pp7Pad<float, float>;
+        d->pp7Blend = pp7Blend<float, float>;
+        d->pp7Residual = pp7Residual<float, float>;
+        d->pp7Convert = pp7Convert<float, float>;
+        d->pp7Row = pp7Row_c<float>;
 
 #ifdef VS_TARGET_CPU_X86
         if ((opt == 0 && iset >= 5) || opt == 3)
-            d->pp7Filter = pp7Filter_sse4<float>;
+            d->pp7Row = pp7Row_sse4<float>;
         else if ((opt == 0 && iset >= 2) || opt == 2)
-            d->pp7Filter = pp7Filter_sse2<float>;
+            d->pp7Row = pp7Row_sse2<float>;
 #endif
     }
 }
 
 static void VS_CC pp7Init(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
     DeblockPP7Data * d = static_cast<DeblockPP7Data *>(*instanceData);
-    vsapi->setVideoInfo(d->vi, 1, node);
+    VSVideoInfo output = *d->vi;
+    output.format = d->outFormat;
+    const std::vector<VSVideoInfo> vi(d->clips, output);
+    vsapi->setVideoInfo(vi.data(), d->clips, node);
 }
 
 static const VSFrameRef *VS_CC pp7GetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
     DeblockPP7Data * d = static_cast<DeblockPP7Data *>(*instanceData);
 
+    // Number of frames filtered by this call when it leads a batch.
+    const int count = (d->batch > 1 && n % d->batch == 0) ? std::min(d->batch, d->vi->numFrames - n) : 1;
+
     if (activationReason == arInitial) {
-        vsapi->requestFrameFilter(n, d->node, frameCtx);
+        for (int i = 0; i < count; i++) {
+            vsapi->requestFrameFilter(n + i, d->node, frameCtx);
+            if (d->qpMap)
+                vsapi->requestFrameFilter(n + i, d->qpMap, frameCtx);
+            if (d->mask)
+                vsapi->requestFrameFilter(n + i, d->mask, frameCtx);
+        }
+
+        if (d->temporal && n > 0)
+            vsapi->requestFrameFilter(n - 1, d->node, frameCtx);
+
+        // Ask for the following frames as well so that their decoding overlaps with filtering this one.
+        for (int i = count; i <= d->prefetch && n + i < d->vi->numFrames; i++)
+            vsapi->requestFrameFilter(n + i, d->node, frameCtx);
     } else if (activationReason == arAllFramesReady) {
-        try {
-            auto threadId = std::this_thread::get_id();
+        int * buffer;
 
-            if (!d->buffer.count(threadId)) {
-                int * buffer = reinterpret_cast<int *>(vs_aligned_malloc(d->stride[0] * (d->vi->height + 16 + 8) * sizeof(int), 16));
-                if (!buffer)
-                    throw std::string{ "malloc failure (buffer)" };
-                d->buffer.emplace(threadId, buffer);
-            }
+        try {
+            buffer = getBuffer(d);
         } catch (const std::string & error) {
             vsapi->setFilterError(("DeblockPP7: " + error).c_str(), frameCtx);
             return nullptr;
         }
 
-        const VSFrameRef * src = vsapi->getFrameFilter(n, d->node, frameCtx);
-        const VSFrameRef * fr[] = { d->process[0] ? nullptr : src, d->process[1] ? nullptr : src, d->process[2] ? nullptr : src };
-        const int pl[] = { 0, 1, 2 };
-        VSFrameRef * dst = vsapi->newVideoFrame2(d->vi->format, d->vi->width, d->vi->height, fr, pl, src, core);
+        // Frames of a batch that are not yet claimed by their own call are filtered here; the others filter themselves.
+        // Every frame is filtered for all clips at once, and the calls for the other clips pick up the result. Results
+        // are keyed by frame number times d->clips plus output index.
+        const int index = vsapi->getOutputIndex(frameCtx);
+        const int clips = d->clips;
+        std::vector<int> frames{ n };
+
+        if (d->batch > 1 || clips > 1) {
+            std::unique_lock<std::mutex> lock{ d->batchLock };
+
+            // The entry is looked up again after every wakeup, since another call waiting for the same key may have taken
+            // it. In that case the frame is filtered here again.
+            const int key = clips * n + index;
+            auto iter = d->batchFrames.find(key);
+            if (iter != d->batchFrames.end()) {
+                iter->second.waiters++;
+                d->batchReady.wait(lock, [&] {
+                    iter = d->batchFrames.find(key);
+                    return iter == d->batchFrames.end() || iter->second.frame;
+                });
+
+                if (iter != d->batchFrames.end()) {
+                    const VSFrameRef * dst = iter->second.frame;
+                    if (--iter->second.waiters > 0)
+                        return vsapi->cloneFrameRef(dst);
+                    d->batchFrames.erase(iter);
+                    return dst;
+                }
+            }
+
+            for (int k = 0; k < clips; k++) {
+                if (k != index)
+                    d->batchFrames.emplace(clips * n + k, DeblockPP7Result{});
+            }
+
+            if (count > 1) {
+                // A claim is dropped by the leader of its batch, so that a frame filtered by its own call is not filtered
+                // again by a leader that comes late. Claims whose leader is never requested age out with the results.
+                for (int i = 1; i < count; i++) {
+                    if (!d->batchTaken.erase(n + i)) {
+                        for (int k = 0; k < clips; k++)
+                            d->batchFrames.emplace(clips * (n + i) + k, DeblockPP7Result{});
+                        frames.push_back(n + i);
+                    }
+                }
+            } else if (d->batch > 1) {
+                d->batchTaken.insert(n);
+            }
+        }
+
+        const int numFrames = static_cast<int>(frames.size());
+        std::vector<const VSFrameRef *> src(numFrames);
+        std::vector<VSFrameRef *> dst(numFrames * clips);
+        std::vector<uint64_t> hashes(numFrames);
+        std::vector<bool> reused(numFrames);
+        std::vector<double> qps(numFrames);
+        std::vector<std::shared_ptr<const DeblockPP7Table>> tables(numFrames);
+
+        for (int i = 0; i < numFrames; i++) {
+            src[i] = vsapi->getFrameFilter(frames[i], d->node, frameCtx);
+            qps[i] = frameQp(src[i], d, vsapi);
+
+            if (d->dedup) {
+                hashes[i] = hashFrame(src[i], d, vsapi);
+                reused[i] = findDuplicate(hashes[i], qps[i], src[i], dst.data() + clips * i, d, core, vsapi);
+                if (reused[i])
+                    continue;
+            }
+
+            tables[i] = frameTable(qps[i], d);
+
+            // Residuals are written for every plane, and so are the outputs if they are converted to another depth.
+            const bool copied = d->outFormat == d->vi->format;
+            const VSFrameRef * fr[] = { (d->process[0] || !copied) ? nullptr : src[i], (d->process[1] || !copied) ? nullptr : src[i],
+                                        (d->process[2] || !copied) ? nullptr : src[i] };
+            const VSFrameRef * none[] = { nullptr, nullptr, nullptr };
+            const int pl[] = { 0, 1, 2 };
+            for (int k = 0; k < clips; k++)
+                dst[clips * i + k] = vsapi->newVideoFrame2(d->outFormat, d->vi->width, d->vi->height, (k < d->outputs) ? fr : none, pl, src[i], core);
+        }
+
+        // The previous output of a frame is the one filtered just before it in this call, or otherwise a cached one. It is
+        // only of use if it was filtered with the same qp.
+        std::vector<const VSFrameRef *> prevSrc(numFrames), prevDst(numFrames * clips);
+
+        if (d->temporal) {
+            if (n > 0) {
+                std::lock_guard<std::mutex> lock{ d->temporalLock };
+
+                if (d->temporalFrames.count(clips * (n - 1))) {
+                    const VSFrameRef * prev = vsapi->getFrameFilter(n - 1, d->node, frameCtx);
+                    if (frameQp(prev, d, vsapi) == qps[0]) {
+                        prevSrc[0] = prev;
+                        for (int k = 0; k < clips; k++)
+                            prevDst[k] = vsapi->cloneFrameRef(d->temporalFrames.at(clips * (n - 1) + k));
+                    } else {
+                        vsapi->freeFrame(prev);
+                    }
+                }
+            }
+
+            for (int i = 1; i < numFrames; i++) {
+                if (frames[i] == frames[i - 1] + 1 && qps[i] == qps[i - 1]) {
+                    prevSrc[i] = src[i - 1];
+                    for (int k = 0; k < clips; k++)
+                        prevDst[clips * i + k] = dst[clips * (i - 1) + k];
+                }
+            }
+        }
+
+        // Frames answered from the duplicate cache are already complete.
+        std::vector<const VSFrameRef *> filterSrc, filterPrevSrc, filterPrevDst, filterMaps, filterMasks;
+        std::vector<VSFrameRef *> filterDst;
+        std::vector<const DeblockPP7Table *> filterTables;
+
+        for (int i = 0; i < numFrames; i++) {
+            if (!reused[i]) {
+                filterSrc.push_back(src[i]);
+                filterTables.push_back(tables[i].get());
+                filterMaps.push_back(d->qpMap ? vsapi->getFrameFilter(frames[i], d->qpMap, frameCtx) : nullptr);
+                filterMasks.push_back(d->mask ? vsapi->getFrameFilter(frames[i], d->mask, frameCtx) : nullptr);
+                filterPrevSrc.push_back(prevSrc[i]);
+                for (int k = 0; k < clips; k++) {
+                    filterDst.push_back(dst[clips * i + k]);
+                    filterPrevDst.push_back(prevDst[clips * i + k]);
+                }
+            }
+        }
+
+        if (!filterSrc.empty())
+            pp7Filter(filterSrc.data(), filterDst.data(), filterPrevSrc.data(), filterPrevDst.data(), filterTables.data(), filterMaps.data(),
+                      filterMasks.data(), static_cast<int>(filterSrc.size()), buffer, d, vsapi);
+
+        if (d->dedup) {
+            for (int i = 0; i < numFrames; i++) {
+                if (!reused[i])
+                    rememberFrame(hashes[i], qps[i], src[i], dst.data() + clips * i, d, vsapi);
+            }
+        }
+
+        for (auto frame : src)
+            vsapi->freeFrame(frame);
+        for (auto frame : filterMaps)
+            vsapi->freeFrame(frame);
+        for (auto frame : filterMasks)
+            vsapi->freeFrame(frame);
+
+        if (d->temporal) {
+            vsapi->freeFrame(prevSrc[0]);
+            for (int k = 0; k < clips; k++)
+                vsapi->freeFrame(prevDst[k]);
+
+            std::lock_guard<std::mutex> lock{ d->temporalLock };
+
+            for (int i = 0; i < numFrames; i++) {
+                if (!d->temporalFrames.count(clips * frames[i])) {
+                    for (int k = 0; k < clips; k++)
+                        d->temporalFrames.emplace(clips * frames[i] + k, vsapi->cloneFrameRef(dst[clips * i + k]));
+                }
+            }
+
+            for (auto iter = d->temporalFrames.begin(); iter != d->temporalFrames.end();) {
+                if (iter->first / clips < n - d->batch * d->numThreads) {
+                    vsapi->freeFrame(iter->second);
+                    iter = d->temporalFrames.erase(iter);
+                } else {
+                    ++iter;
+                }
+            }
+        }
+
+        if (d->batch > 1 || clips > 1) {
+            std::lock_guard<std::mutex> lock{ d->batchLock };
+
+            for (int i = 0; i < numFrames; i++) {
+                for (int k = 0; k < clips; k++) {
+                    if (i == 0 && k == index)
+                        continue;
+
+                    // A result that is still waiting from an earlier request of the same frame is kept.
+                    DeblockPP7Result & result = d->batchFrames[clips * frames[i] + k];
+                    if (result.frame)
+                        vsapi->freeFrame(dst[clips * i + k]);
+                    else
+                        result.frame = dst[clips * i + k];
+                }
+            }
+
+            // Drop results nobody asked for, e.g. after a seek. Such a frame is simply filtered again if it is requested later.
+            // Results with waiters are kept however old they are.
+            for (auto iter = d->batchFrames.begin(); iter != d->batchFrames.end();) {
+                if (iter->second.frame && !iter->second.waiters && iter->first / clips < n - d->batch * d->numThreads) {
+                    vsapi->freeFrame(iter->second.frame);
+                    iter = d->batchFrames.erase(iter);
+                } else {
+                    ++iter;
+                }
+            }
 
-        d->pp7Filter(src, dst, d, vsapi);
+            for (auto iter = d->batchTaken.begin(); iter != d->batchTaken.end();) {
+                if (*iter < n - d->batch * d->numThreads)
+                    iter = d->batchTaken.erase(iter);
+                else
+                    ++iter;
+            }
+        }
+        if (numFrames > 1 || clips > 1)
+            d->batchReady.notify_all();
 
-        vsapi->freeFrame(src);
-        return dst;
+        return dst[index];
     }
 
     return nullptr;
@@ -332,13 +1619,57 @@ static void VS_CC pp7Free(void *instanceData, VSCore *core, const VSAPI *vsapi)
     DeblockPP7Data * d = static_cast<DeblockPP7Data *>(instanceData);
 
     vsapi->freeNode(d->node);
+    vsapi->freeNode(d->qpMap);
+    vsapi->freeNode(d->mask);
 
     for (auto & iter : d->buffer)
         vs_aligned_free(iter.second);
 
+    vs_aligned_free(d->pipelineBuffer);
+
+    for (auto & iter : d->batchFrames)
+        vsapi->freeFrame(iter.second.frame);
+
+    for (auto & iter : d->temporalFrames)
+        vsapi->freeFrame(iter.second);
+
+    for (auto & iter : d->duplicates) {
+        vsapi->freeFrame(iter.src);
+        for (int k = 0; k < d->clips; k++)
+            vsapi->freeFrame(iter.dst[k]);
+    }
+
     delete d;
 }
 
+/*
+ * Extends node to the right and bottom by repeating its last column and row, and releases the reference to node. The
+ * reference is kept if resizing fails.
+ */
+static VSNodeRef * padNode(VSNodeRef * node, const int padWidth, const int padHeight, VSCore * core, const VSAPI * vsapi) {
+    const VSVideoInfo * vi = vsapi->getVideoInfo(node);
+
+    VSMap * args = vsapi->createMap();
+    vsapi->propSetNode(args, "clip", node, paReplace);
+    vsapi->propSetInt(args, "width", vi->width + padWidth, paReplace);
+    vsapi->propSetInt(args, "height", vi->height + padHeight, paReplace);
+    vsapi->propSetFloat(args, "src_width", vi->width + padWidth, paReplace);
+    vsapi->propSetFloat(args, "src_height", vi->height + padHeight, paReplace);
+
+    VSMap * ret = vsapi->invoke(vsapi->getPluginById("com.vapoursynth.resize", core), "Point", args);
+    vsapi->freeMap(args);
+    if (vsapi->getError(ret)) {
+        const std::string error{ vsapi->getError(ret) };
+        vsapi->freeMap(ret);
+        throw error;
+    }
+
+    VSNodeRef * padded = vsapi->propGetNode(ret, "clip", 0, nullptr);
+    vsapi->freeMap(ret);
+    vsapi->freeNode(node);
+    return padded;
+}
+
 static void VS_CC pp7Create(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
     std::unique_ptr<DeblockPP7Data> d{ new DeblockPP7Data{} };
     int err;
@@ -351,17 +1682,93 @@ static void VS_CC pp7Create(const VSMap *in, VSMap *out, void *userData, VSCore
 
     try {
         if (!isConstantFormat(d->vi) || (d->vi->format->sampleType == stInteger && d->vi->format->bitsPerSample > 16) ||
-            (d->vi->format->sampleType == stFloat && d->vi->format->bitsPerSample != 32))
-            throw std::string{ "only constant format 8-16 bit integer and 32 bit float input supported" };
+            (d->vi->format->sampleType == stFloat && d->vi->format->bitsPerSample != 16 && d->vi->format->bitsPerSample != 32))
+            throw std::string{ "only constant format 8-16 bit integer and 16/32 bit float input supported" };
+
+        d->half = d->vi->format->sampleType == stFloat && d->vi->format->bitsPerSample == 16;
 
-        double qp = vsapi->propGetFloat(in, "qp", 0, &err);
+        const int numQp = vsapi->propNumElements(in, "qp");
+        if (numQp > OUTPUTS)
+            throw std::string{ "qp must not have more than " + std::to_string(OUTPUTS) + " values" };
+
+        d->outputs = std::max(numQp, 1);
+
+        d->residual = !!vsapi->propGetInt(in, "residual", 0, &err);
+        d->clips = d->residual ? 2 * d->outputs : d->outputs;
+
+        int outputDepth = int64ToIntS(vsapi->propGetInt(in, "output_depth", 0, &err));
         if (err)
-            qp = 2.;
+            outputDepth = d->vi->format->bitsPerSample;
+        double qp[OUTPUTS] = { 2. };
+        for (int k = 0; k < numQp; k++)
+            qp[k] = vsapi->propGetFloat(in, "qp", k, nullptr);
 
         d->mode = int64ToIntS(vsapi->propGetInt(in, "mode", 0, &err));
 
+        d->strength = static_cast<float>(vsapi->propGetFloat(in, "strength", 0, &err));
+        if (err)
+            d->strength = 1.f;
+
+        const double limit = vsapi->propGetFloat(in, "limit", 0, &err);
+
+        const double limitSoft = vsapi->propGetFloat(in, "limit_soft", 0, &err);
+
         const int opt = int64ToIntS(vsapi->propGetInt(in, "opt", 0, &err));
 
+        d->prefetch = int64ToIntS(vsapi->propGetInt(in, "prefetch", 0, &err));
+
+        const int threads = int64ToIntS(vsapi->propGetInt(in, "threads", 0, &err));
+
+        const bool affinity = !!vsapi->propGetInt(in, "affinity", 0, &err);
+
+        const bool smt = !!vsapi->propGetInt(in, "smt", 0, &err);
+
+        d->batch = int64ToIntS(vsapi->propGetInt(in, "batch", 0, &err));
+        if (err)
+            d->batch = 1;
+
+        d->band = int64ToIntS(vsapi->propGetInt(in, "band", 0, &err));
+        if (err)
+            d->band = 16;
+
+        d->depth = int64ToIntS(vsapi->propGetInt(in, "depth", 0, &err));
+        if (err)
+            d->depth = 2 * (threads + 1);
+
+        d->temporal = !!vsapi->propGetInt(in, "temporal", 0, &err);
+
+        d->dedup = int64ToIntS(vsapi->propGetInt(in, "dedup", 0, &err));
+
+        const int lut = int64ToIntS(vsapi->propGetInt(in, "lut", 0, &err));
+
+        d->speed = int64ToIntS(vsapi->propGetInt(in, "speed", 0, &err));
+
+        d->fixed = !!vsapi->propGetInt(in, "fixed", 0, &err);
+
+        const char * qpProp = vsapi->propGetData(in, "qpprop", 0, &err);
+        if (!err)
+            d->qpProp = qpProp;
+
+        d->qpMap = vsapi->propGetNode(in, "qpmap", 0, &err);
+
+        d->mask = vsapi->propGetNode(in, "mask", 0, &err);
+
+        int qpBlock = int64ToIntS(vsapi->propGetInt(in, "qpblock", 0, &err));
+        if (err)
+            qpBlock = 16;
+
+        d->left = int64ToIntS(vsapi->propGetInt(in, "left", 0, &err));
+
+        d->top = int64ToIntS(vsapi->propGetInt(in, "top", 0, &err));
+
+        int roiWidth = int64ToIntS(vsapi->propGetInt(in, "width", 0, &err));
+        if (err)
+            roiWidth = d->vi->width - d->left;
+
+        int roiHeight = int64ToIntS(vsapi->propGetInt(in, "height", 0, &err));
+        if (err)
+            roiHeight = d->vi->height - d->top;
+
         const int m = vsapi->propNumElements(in, "planes");
 
         for (int i = 0; i < 3; i++)
@@ -379,86 +1786,278 @@ static void VS_CC pp7Create(const VSMap *in, VSMap *out, void *userData, VSCore
             d->process[n] = true;
         }
 
-        if (qp < 1. || qp > 63.)
-            throw std::string{ "qp must be between 1.0 and 63.0 (inclusive)" };
+        for (int k = 0; k < d->outputs; k++) {
+            if (qp[k] < 1. || qp[k] > 63.)
+                throw std::string{ "qp must be between 1.0 and 63.0 (inclusive)" };
+        }
+
+        if (!d->qpProp.empty() && d->outputs > 1)
+            throw std::string{ "qpprop cannot be combined with several qp values" };
+
+        if (d->mask) {
+            const VSVideoInfo * maskVi = vsapi->getVideoInfo(d->mask);
+
+            if (!isSameFormat(maskVi, d->vi))
+                throw std::string{ "mask must have the same format and dimensions as clip" };
+
+            if (maskVi->numFrames < d->vi->numFrames)
+                throw std::string{ "mask must have at least as many frames as clip" };
+
+            if (d->temporal || d->dedup)
+                throw std::string{ "mask cannot be combined with temporal or dedup" };
+        }
+
+        if (d->left < 0 || d->top < 0 || roiWidth < 1 || roiHeight < 1 || d->left + roiWidth > d->vi->width || d->top + roiHeight > d->vi->height)
+            throw std::string{ "left, top, width and height must describe a non-empty rectangle within clip" };
+
+        // A rectangle reaching the right or bottom edge also covers the padding.
+        d->right = (d->left + roiWidth < d->vi->width) ? d->left + roiWidth : 0;
+        d->bottom = (d->top + roiHeight < d->vi->height) ? d->top + roiHeight : 0;
+
+        if (((d->left | d->right) & ((1 << d->vi->format->subSamplingW) - 1)) || ((d->top | d->bottom) & ((1 << d->vi->format->subSamplingH) - 1)))
+            throw std::string{ "left, top, width and height must be multiples of the subsampling" };
+
+        if (qpBlock != 8 && qpBlock != 16)
+            throw std::string{ "qpblock must be 8 or 16" };
+
+        d->qpShift = (qpBlock == 16) ? 4 : 3;
+
+        if (d->qpMap) {
+            const VSVideoInfo * mapVi = vsapi->getVideoInfo(d->qpMap);
+
+            if (!isConstantFormat(mapVi) || mapVi->format->sampleType != stInteger || mapVi->format->bitsPerSample != 8)
+                throw std::string{ "qpmap must be a constant format 8 bit integer clip" };
+
+            if (mapVi->width < (d->vi->width + qpBlock - 1) / qpBlock || mapVi->height < (d->vi->height + qpBlock - 1) / qpBlock)
+                throw std::string{ "qpmap must have at least one sample per qpblock x qpblock block of clip" };
+
+            if (mapVi->numFrames < d->vi->numFrames)
+                throw std::string{ "qpmap must have at least as many frames as clip" };
+
+            if (d->outputs > 1 || !d->qpProp.empty())
+                throw std::string{ "qpmap cannot be combined with several qp values or qpprop" };
+
+            if (d->temporal || d->dedup)
+                throw std::string{ "qpmap cannot be combined with temporal or dedup" };
+
+            if (d->vi->format->subSamplingW > d->qpShift || d->vi->format->subSamplingH > d->qpShift)
+                throw std::string{ "qpmap does not support this subsampling" };
+        }
 
         if (d->mode < 0 || d->mode > 2)
             throw std::string{ "mode must be 0, 1 or 2" };
 
+        if (d->strength < 0.f || d->strength > 1.f)
+            throw std::string{ "strength must be between 0.0 and 1.0 (inclusive)" };
+
+        // The same rounding as std.Merge.
+        d->weight = static_cast<int>(d->strength * 32768.f + 0.5f);
+
+        if (limit < 0.)
+            throw std::string{ "limit must be greater than or equal to 0.0" };
+
+        if (limitSoft < 0. || limitSoft > limit)
+            throw std::string{ "limit_soft must be between 0.0 and limit (inclusive)" };
+
+        if (outputDepth != d->vi->format->bitsPerSample) {
+            if (d->vi->format->sampleType != stInteger)
+                throw std::string{ "output_depth is only supported for integer input" };
+
+            if (outputDepth < d->vi->format->bitsPerSample || outputDepth > 16)
+                throw std::string{ "output_depth must be between the bit depth of clip and 16 (inclusive)" };
+        }
+
+        // Both are given in 8 bit units of the output, and 0 disables the limit.
+        const double limitScale = (d->vi->format->sampleType == stInteger) ? ((1 << outputDepth) - 1) / 255. : 1. / 255.;
+        d->limit = (limit > 0.) ? static_cast<float>(limit * limitScale) : FLT_MAX;
+        d->limitSoft = static_cast<float>(limitSoft * limitScale);
+        d->limitKnee = (limitSoft > 0.) ? 1.f / (4.f * d->limitSoft) : 0.f;
+
         if (opt < 0 || opt > 3)
             throw std::string{ "opt must be 0, 1, 2 or 3" };
 
-        if (padWidth || padHeight) {
-            VSMap * args = vsapi->createMap();
-            vsapi->propSetNode(args, "clip", d->node, paReplace);
-            vsapi->freeNode(d->node);
-            vsapi->propSetInt(args, "width", d->vi->width + padWidth, paReplace);
-            vsapi->propSetInt(args, "height", d->vi->height + padHeight, paReplace);
-            vsapi->propSetFloat(args, "src_width", d->vi->width + padWidth, paReplace);
-            vsapi->propSetFloat(args, "src_height", d->vi->height + padHeight, paReplace);
-
-            VSMap * ret = vsapi->invoke(vsapi->getPluginById("com.vapoursynth.resize", core), "Point", args);
-            if (vsapi->getError(ret)) {
-                vsapi->setError(out, vsapi->getError(ret));
-                vsapi->freeMap(args);
-                vsapi->freeMap(ret);
-                return;
-            }
+        if (d->prefetch < 0)
+            throw std::string{ "prefetch must be greater than or equal to 0" };
+
+        if (threads < 0)
+            throw std::string{ "threads must be greater than or equal to 0" };
+
+        if (d->batch < 1)
+            throw std::string{ "batch must be greater than or equal to 1" };
+
+        if (d->band < 1)
+            throw std::string{ "band must be greater than or equal to 1" };
 
-            d->node = vsapi->propGetNode(ret, "clip", 0, nullptr);
+        if (d->depth < 1)
+            throw std::string{ "depth must be greater than or equal to 1" };
+
+        if (d->dedup < 0)
+            throw std::string{ "dedup must be greater than or equal to 0" };
+
+        if (lut < 0 || lut > 2)
+            throw std::string{ "lut must be 0, 1 or 2" };
+
+        if (lut == 2 && d->vi->format->bytesPerSample != 1)
+            throw std::string{ "lut=2 is only supported for 8 bit input" };
+
+        if (d->speed < 0 || d->speed > 2)
+            throw std::string{ "speed must be 0, 1 or 2" };
+
+        if (d->fixed && (d->vi->format->sampleType != stFloat || d->half))
+            throw std::string{ "fixed is only supported for 32 bit float input" };
+
+        if (padWidth || padHeight) {
+            d->node = padNode(d->node, padWidth, padHeight, core, vsapi);
             d->vi = vsapi->getVideoInfo(d->node);
-            vsapi->freeMap(args);
-            vsapi->freeMap(ret);
+
+            if (d->mask)
+                d->mask = padNode(d->mask, padWidth, padHeight, core, vsapi);
         }
 
-        selectFunctions(opt, d.get());
+        d->outFormat = d->vi->format;
+        if (outputDepth != d->vi->format->bitsPerSample)
+            d->outFormat = vsapi->registerFormat(d->vi->format->colorFamily, stInteger, outputDepth, d->vi->format->subSamplingW,
+                                                 d->vi->format->subSamplingH, core);
 
-        const unsigned numThreads = vsapi->getCoreInfo(core)->numThreads;
-        d->buffer.reserve(numThreads);
+        selectFunctions(opt, d.get());
 
-        d->peak = (d->vi->format->sampleType == stInteger) ? (1 << d->vi->format->bitsPerSample) - 1 : 255;
+        d->numThreads = vsapi->getCoreInfo(core)->numThreads;
+        d->buffer.reserve(d->numThreads);
+
+        if (d->fixed)
+            d->peak = 65535;
+        else
+            d->peak = (d->vi->format->sampleType == stInteger) ? (1 << d->vi->format->bitsPerSample) - 1 : 255;
+
+        // The kernel rounds to the depth of the source, and a deeper output keeps that many more of its fractional bits.
+        d->outShift = (d->vi->format->sampleType == stInteger) ? outputDepth - d->vi->format->bitsPerSample : 0;
+        d->outPeak = (d->peak + 1) * (1u << d->outShift) - 1;
+
+        // The limit is applied to the unrounded output of the kernels: the integer kernel counts in steps of
+        // 2^(18 - outShift) units per output sample, of 16 bit samples in fixed point, and the float kernel's output is
+        // scaled on store. The largest change kept rounds to at most the limit.
+        if (d->limit < FLT_MAX && (d->vi->format->sampleType == stInteger || d->fixed)) {
+            const double step = static_cast<double>(1 << (18 - d->outShift));
+            const double unit = (d->vi->format->sampleType == stInteger) ? step : step * 65535.;
+            d->limitUnit = static_cast<float>(1. / unit);
+            d->limitCap = static_cast<int64_t>((std::floor(d->limit * unit / step) + 0.5) * step) - 1;
+            d->limitKeep = std::min(static_cast<int64_t>((d->limit - d->limitSoft) * unit), d->limitCap);
+        }
 
         for (int plane = 0; plane < d->vi->format->numPlanes; plane++) {
             const int width = d->vi->width >> (plane ? d->vi->format->subSamplingW : 0);
             d->stride[plane] = (width + 16 + 15) & ~15;
         }
 
-        for (int i = 0; i < 16; i++)
-            d->thresh[i] = static_cast<unsigned>((((i & 1) ? SN2 : SN0) * ((i & 4) ? SN2 : SN0) * qp * (1 << 2) - 1) * d->peak / 255.);
+        if (threads > 0) {
+            d->ringRows = d->depth * d->band + 8;
+
+            const size_t size = (d->ringRows * d->stride[0] + DeblockPP7Stream::scratchSize(d->stride[0], d.get()) * (threads + 1)) * sizeof(int);
+            d->pipelineBuffer = reinterpret_cast<int *>(vs_aligned_malloc(size, 16));
+            if (!d->pipelineBuffer)
+                throw std::string{ "malloc failure (pipelineBuffer)" };
+
+            d->progress.reset(new DeblockPP7Progress[threads + 2]);
+            // Threads are only pinned on request, and the CPUs chosen are logged since they differ per instance.
+            std::vector<int> cpus;
+            if (affinity) {
+                cpus = poolCpus(threads, smt, true);
+
+                std::string message = "DeblockPP7: threads pinned to CPUs";
+                for (size_t i = 0; i < cpus.size(); i++)
+                    message += (i ? ", " : " ") + std::to_string(cpus[i]);
+                if (cpus.empty())
+                    message = "DeblockPP7: threads not pinned, the CPU topology cannot be read";
+                vsapi->logMessage(mtDebug, message.c_str());
+            }
+            d->pool.reset(new DeblockPP7Pool{ threads, cpus });
+        }
+
+        d->lut = d->vi->format->bytesPerSample == 1 && lut != 1;
+        d->table = buildTable(qp, d.get());
+
+        if (lut == 0 && d->lut && !lutFaster(d.get())) {
+            d->lut = false;
+            d->table = buildTable(qp, d.get());
+        }
+
+        // Map samples above 63 use qp 63, and 0 stands for the qp argument.
+        if (d->qpMap) {
+            d->mapTable[0] = d->table;
+            for (int k = 1; k < 64; k++) {
+                const double mapQp = k;
+                d->mapTable[k] = buildTable(&mapQp, d.get());
+            }
+        }
     } catch (const std::string & error) {
         vsapi->setError(out, ("DeblockPP7: " + error).c_str());
         vsapi->freeNode(d->node);
+        vsapi->freeNode(d->qpMap);
+        vsapi->freeNode(d->mask);
         return;
     }
 
     vsapi->createFilter(in, out, "DeblockPP7", pp7Init, pp7GetFrame, pp7Free, fmParallel, 0, d.release(), core);
 
+    // Every output is cropped back to the size of the input.
     if (padWidth || padHeight) {
-        VSNodeRef * node = vsapi->propGetNode(out, "clip", 0, nullptr);
+        std::vector<VSNodeRef *> nodes;
+        for (int k = 0; k < vsapi->propNumElements(out, "clip"); k++)
+            nodes.push_back(vsapi->propGetNode(out, "clip", k, nullptr));
         vsapi->clearMap(out);
 
-        VSMap * args = vsapi->createMap();
-        vsapi->propSetNode(args, "clip", node, paReplace);
-        vsapi->freeNode(node);
-        vsapi->propSetInt(args, "right", padWidth, paReplace);
-        vsapi->propSetInt(args, "bottom", padHeight, paReplace);
+        for (auto node : nodes) {
+            VSMap * args = vsapi->createMap();
+            vsapi->propSetNode(args, "clip", node, paReplace);
+            vsapi->propSetInt(args, "right", padWidth, paReplace);
+            vsapi->propSetInt(args, "bottom", padHeight, paReplace);
 
-        VSMap * ret = vsapi->invoke(vsapi->getPluginById("com.vapoursynth.std", core), "Crop", args);
-        if (vsapi->getError(ret)) {
-            vsapi->setError(out, vsapi->getError(ret));
+            VSMap * ret = vsapi->invoke(vsapi->getPluginById("com.vapoursynth.std", core), "Crop", args);
             vsapi->freeMap(args);
+            if (vsapi->getError(ret)) {
+                vsapi->clearMap(out);
+                vsapi->setError(out, vsapi->getError(ret));
+                vsapi->freeMap(ret);
+                for (auto iter : nodes)
+                    vsapi->freeNode(iter);
+                return;
+            }
+
+            VSNodeRef * cropped = vsapi->propGetNode(ret, "clip", 0, nullptr);
             vsapi->freeMap(ret);
-            return;
+            vsapi->propSetNode(out, "clip", cropped, paAppend);
+            vsapi->freeNode(cropped);
         }
 
-        node = vsapi->propGetNode(ret, "clip", 0, nullptr);
-        vsapi->freeMap(args);
-        vsapi->freeMap(ret);
-        vsapi->propSetNode(out, "clip", node, paReplace);
-        vsapi->freeNode(node);
+        for (auto node : nodes)
+            vsapi->freeNode(node);
     }
 }
 
+static void VS_CC poolInfoCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+    int err;
+
+    int threads = int64ToIntS(vsapi->propGetInt(in, "threads", 0, &err));
+    const bool smt = !!vsapi->propGetInt(in, "smt", 0, &err);
+
+    const auto cores = physicalCores();
+    const auto layout = poolLayout(smt);
+
+    int logicalCpus = 0;
+    for (auto & iter : cores)
+        logicalCpus += static_cast<int>(iter.size());
+
+    if (threads <= 0)
+        threads = static_cast<int>(layout.size());
+
+    vsapi->propSetInt(out, "physical_cores", cores.size(), paReplace);
+    vsapi->propSetInt(out, "logical_cpus", logicalCpus, paReplace);
+
+    const auto next = poolCpus(threads, smt, false);
+    const std::vector<int64_t> cpus(next.begin(), next.end());
+    vsapi->propSetIntArray(out, "cpus", cpus.data(), static_cast<int>(cpus.size()));
+}
+
 //////////////////////////////////////////
 // Init
 
@@ -466,9 +2065,38 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit(VSConfigPlugin configFunc, VSRegiste
     configFunc("com.holywu.pp7", "pp7", "Postprocess 7 from MPlayer", VAPOURSYNTH_API_VERSION, 1, plugin);
     registerFunc("DeblockPP7",
                  "clip:clip;"
-                 "qp:float:opt;"
+                 "qp:float[]:opt;"
                  "mode:int:opt;"
                  "opt:int:opt;"
-                 "planes:int[]:opt;",
+                 "planes:int[]:opt;"
+                 "prefetch:int:opt;"
+                 "threads:int:opt;"
+                 "band:int:opt;"
+                 "depth:int:opt;"
+                 "batch:int:opt;"
+                 "affinity:int:opt;"
+                 "smt:int:opt;"
+                 "temporal:int:opt;"
+                 "dedup:int:opt;"
+                 "lut:int:opt;"
+                 "speed:int:opt;"
+                 "fixed:int:opt;"
+                 "qpprop:data:opt;"
+                 "qpmap:clip:opt;"
+                 "qpblock:int:opt;"
+                 "mask:clip:opt;"
+                 "left:int:opt;"
+                 "top:int:opt;"
+                 "width:int:opt;"
+                 "height:int:opt;"
+                 "strength:float:opt;"
+                 "limit:float:opt;"
+                 "limit_soft:float:opt;"
+                 "residual:int:opt;"
+                 "output_depth:int:opt;",
                  pp7Create, nullptr, plugin);
+    registerFunc("PoolInfo",
+                 "threads:int:opt;"
+                 "smt:int:opt;",
+                 poolInfoCreate, nullptr, plugin);
 }
@@ -1,8 +1,21 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <thread>
+#include <type_traits>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include <VapourSynth.h>
 #include <VSHelper.h>
@@ -10,6 +23,9 @@
 #ifdef VS_TARGET_CPU_X86
 #define MAX_VECTOR_SIZE 128
 #include "vectorclass/vectorclass.h"
+
+// Defined in vectorclass/instrset_detect.cpp but not declared by instrset.h.
+bool hasF16C(void);
 #endif
 
 static constexpr int N = 1 << 16;
@@ -19,19 +35,847 @@ static constexpr int N2 = 10;
 static constexpr int SN0 = 2;
 static constexpr double SN2 = 3.1622776601683795;
 
+// Number of widened rows kept by a stream. 7 are needed by the transform, one more is being filled.
+static constexpr int RING = 8;
+
+// Maximum number of qp values, and thus of output clips, of one filter instance.
+static constexpr int OUTPUTS = 8;
+
+/*
+ * Fixed set of worker threads owned by one filter instance. Only one job runs at a time; a frame that finds the pool
+ * busy is filtered by its own thread instead of waiting.
+ */
+class DeblockPP7Pool {
+public:
+    // Worker i is pinned to cpus[(i - 1) % cpus.size()], or left to the scheduler if cpus is empty.
+    DeblockPP7Pool(const int numWorkers, const std::vector<int> & cpus);
+    ~DeblockPP7Pool();
+
+    int size() const noexcept {
+        return static_cast<int>(workers.size()) + 1;
+    }
+
+    // Runs setup(), then job(0) on the calling thread and job(1..size()-1) on the workers, and returns once all have finished.
+    bool tryRun(const std::function<void()> & setup, const std::function<void(int)> & job);
+
+    // Returns once ready() holds. Polls for a short while first, since the stages of a job usually catch up with each
+    // other within microseconds, then sleeps until the next wake().
+    template<typename F>
+    void waitFor(const F & ready) {
+        for (int i = 0; i < 64; i++) {
+            if (ready())
+                return;
+            std::this_thread::yield();
+        }
+
+        std::unique_lock<std::mutex> lock{ progressLock };
+        sleepers.fetch_add(1);
+        progressChanged.wait(lock, ready);
+        sleepers.fetch_sub(1);
+    }
+
+    // Wakes the threads sleeping in waitFor() after progress was published with a sequentially consistent store, which
+    // orders it against the count of sleepers. Costs a single load if none sleeps.
+    void wake() {
+        if (sleepers.load()) {
+            std::lock_guard<std::mutex> lock{ progressLock };
+            progressChanged.notify_all();
+        }
+    }
+
+private:
+    void workerLoop(const int index);
+
+    std::vector<std::thread> workers;
+    std::mutex busy, mutex, progressLock;
+    std::condition_variable start, done, progressChanged;
+    std::atomic<int> sleepers{ 0 };
+    const std::function<void(int)> * job = nullptr;
+    unsigned generation = 0;
+    int pending = 0;
+    bool stop = false;
+};
+
+// Padded to a cache line so that threads publishing progress do not invalidate each other's counters.
+struct DeblockPP7Progress {
+    std::atomic<int> value;
+    char padding[64 - sizeof(std::atomic<int>)];
+};
+
+// A frame filtered by another call of pp7GetFrame. frame stays null until that call is done, and waiters counts the calls
+// blocked on it so that the entry is not dropped under them.
+struct DeblockPP7Result {
+    const VSFrameRef * frame;
+    int waiters;
+};
+
+// A source frame, the qp it was filtered with and its outputs, kept to answer exact duplicates of the source.
+struct DeblockPP7Duplicate {
+    uint64_t hash;
+    double qp;
+    const VSFrameRef * src, * dst[2 * OUTPUTS];
+};
+
+// Thresholds derived from one qp, and the tables of pp7ThresholdLut built from them. The strengths of a filter instance
+// are sorted by qp, and output is the index of the clip this one belongs to.
+struct DeblockPP7Strength {
+    int output;
+    unsigned thresh[16];
+    std::unique_ptr<int[]> lutTable;
+    const int * lut[16];
+    int lutLimit[16];
+    int flatRange;
+    float flatRangeF;
+};
+
+// The strengths of all outputs for one set of qp values, and the lowest of their flat limits.
+struct DeblockPP7Table {
+    DeblockPP7Strength strength[OUTPUTS];
+    int flatRange;
+    float flatRangeF;
+};
+
+/*
+ * Thresholds of a plane, or of one of its rows as passed to pp7Row. Without a qp map every pixel uses table. Otherwise
+ * qp points to the map, one sample per block of 1 << shiftX by 1 << shiftY pixels, and a pixel uses the table of its
+ * block; blocks past the last of the map's columns and rows use the last one. A plane filtered from pixel (left, top)
+ * on is addressed relative to that pixel, and in a row, pixel x lies at x + offset.
+ */
+struct DeblockPP7Blocks {
+    const DeblockPP7Table * table;
+    const uint8_t * qp;
+    int stride, columns, rows, shiftX, shiftY, left, top, offset;
+};
+
+// Source plane of a plane being filtered, and the plane of the mask if there is one.
+struct DeblockPP7Source {
+    const uint8_t * srcp, * maskp;
+    int srcStride, maskStride;
+};
+
 struct DeblockPP7Data {
     VSNodeRef * node;
     const VSVideoInfo * vi;
-    int mode;
+    int mode, prefetch;
+    float strength;
+    int weight;
+    float limit, limitSoft, limitKnee, limitUnit;
+    int64_t limitKeep, limitCap;
     bool process[3];
     int stride[3];
-    unsigned thresh[16], peak;
+    unsigned peak;
+    const VSFormat * outFormat;
+    int outShift;
+    unsigned outPeak;
+    int speed;
+    bool fixed;
+    bool half;
+    int outputs;
+    bool residual;
+    int clips;
+    bool lut;
+    std::shared_ptr<DeblockPP7Table> table;
+    std::string qpProp;
+    std::list<std::pair<double, std::shared_ptr<const DeblockPP7Table>>> tables;
+    std::mutex tableLock;
+    VSNodeRef * qpMap;
+    int qpShift;
+    std::shared_ptr<const DeblockPP7Table> mapTable[64];
+    VSNodeRef * mask;
+    int left, top, right, bottom;
     std::unordered_map<std::thread::id, int *> buffer;
+    std::mutex bufferLock;
+    int batch, numThreads;
+    std::unordered_map<int, DeblockPP7Result> batchFrames;
+    std::unordered_set<int> batchTaken;
+    std::mutex batchLock;
+    std::condition_variable batchReady;
+    bool temporal;
+    std::unordered_map<int, const VSFrameRef *> temporalFrames;
+    std::mutex temporalLock;
+    int dedup;
+    std::list<DeblockPP7Duplicate> duplicates;
+    std::mutex duplicateLock;
     const int16_t factor[16] = {
         N / (N0 * N0), N / (N0 * N1), N / (N0 * N0), N / (N0 * N2),
         N / (N1 * N0), N / (N1 * N1), N / (N1 * N0), N / (N1 * N2),
         N / (N0 * N0), N / (N0 * N1), N / (N0 * N0), N / (N0 * N2),
         N / (N2 * N0), N / (N2 * N1), N / (N2 * N0), N / (N2 * N2)
     };
-    void (*pp7Filter)(const VSFrameRef *, VSFrameRef *, const DeblockPP7Data * const VS_RESTRICT, const VSAPI *) noexcept;
+    int band, depth, ringRows;
+    std::unique_ptr<DeblockPP7Pool> pool;
+    std::unique_ptr<DeblockPP7Progress[]> progress;
+    int * pipelineBuffer;
+    void (*pp7Pad)(const void *, void *, const int) noexcept;
+    void (*pp7Row)(const void * const *, void * const *, const int, void *, const DeblockPP7Blocks * const VS_RESTRICT, const DeblockPP7Data * const VS_RESTRICT) noexcept;
+    void (*pp7Blend)(const void *, const void *, void *, const int, const DeblockPP7Data * const VS_RESTRICT) noexcept;
+    void (*pp7Residual)(const void *, const void *, void *, const int, const DeblockPP7Data * const VS_RESTRICT) noexcept;
+    void (*pp7Convert)(const void *, void *, const int, const DeblockPP7Data * const VS_RESTRICT) noexcept;
+    bool (*pp7Box)(const uint8_t *, const int, uint8_t *, const int, const int, const int, int *, const DeblockPP7Table * const VS_RESTRICT,
+                   const DeblockPP7Data * const VS_RESTRICT) noexcept;
 };
+
+/*
+ * Row-incremental interface to the filter core.
+ *
+ * Source rows are pushed top to bottom. Output row y depends on source rows y-3..y+3, so it is written to dstp[k] for
+ * every output k as soon as row y+3 has been pushed; the last 3 rows are written by finish(). Only RING widened rows are
+ * retained, but the rows of source, the plane the rows are pushed from, are read again for a mask or a residual. With
+ * a mask, only the pixels where it is not zero are filtered and the rows are merged with the source by it. If
+ * d->residual is set, the residual of output k is written to dstp[d->outputs + k]. The thresholds b, source, the dstp
+ * and the dstStride arrays must outlive the stream, and buffer must hold bufferSize(d->stride[plane], d) ints.
+ *
+ * pp7GetFrame drives a stream over whole planes of a frame it already holds. VapourSynth API v3 only hands a frame to the
+ * next filter once getFrame returns, so rows completed early shorten no latency there; that needs a caller of its own.
+ */
+class DeblockPP7Stream {
+public:
+    DeblockPP7Stream(const DeblockPP7Blocks * b, const DeblockPP7Source * source, const DeblockPP7Data * d, const int plane, const int width, const int height,
+                     void * buffer, uint8_t * const * dstp, const int * dstStride) noexcept;
+
+    // Returns the number of output rows completed so far.
+    int pushRow(const void * srcp) noexcept;
+    int finish() noexcept;
+
+    // Half float input is filtered into float rows behind the scratch space of the transform first.
+    static int scratchSize(const int stride, const DeblockPP7Data * d) noexcept {
+        return 16 + 7 * stride + (d->half ? d->outputs * stride : 0);
+    }
+
+    static int bufferSize(const int stride, const DeblockPP7Data * d) noexcept {
+        return scratchSize(stride, d) + RING * stride;
+    }
+
+private:
+
+    const DeblockPP7Blocks * b;
+    const DeblockPP7Source * source;
+    const DeblockPP7Data * d;
+    const int width, height, stride;
+    int * scratch, * ring;
+    uint8_t * const * dstp;
+    const int * dstStride;
+    int rowsIn = 0, rowsOut = 0;
+};
+
+static inline void prefetchRow(const uint8_t * srcp, const int rowSize) noexcept {
+#ifdef VS_TARGET_CPU_X86
+    for (int i = 0; i < rowSize; i += 64)
+        _mm_prefetch(reinterpret_cast<const char *>(srcp + i), _MM_HINT_T0);
+#endif
+}
+
+template<typename T, typename U>
+static void pp7Pad(const void * _srcp, void * _dstp, const int width) noexcept {
+    const T * srcp = static_cast<const T *>(_srcp);
+    U * VS_RESTRICT dstp = static_cast<U *>(_dstp);
+
+    std::copy_n(srcp, width, dstp);
+    for (int x = 0; x < 8; x++) {
+        dstp[-1 - x] = dstp[x];
+        dstp[width + x] = dstp[width - 1 - x];
+    }
+}
+
+// Quantizes float samples in [0, 1] to 16 bit for the integer kernel.
+static inline void pp7PadFixed(const void * _srcp, void * _dstp, const int width) noexcept {
+    const float * srcp = static_cast<const float *>(_srcp);
+    int * VS_RESTRICT dstp = static_cast<int *>(_dstp);
+
+    for (int x = 0; x < width; x++)
+        dstp[x] = static_cast<int>(std::min(std::max(srcp[x], 0.f), 1.f) * 65535.f + 0.5f);
+    for (int x = 0; x < 8; x++) {
+        dstp[-1 - x] = dstp[x];
+        dstp[width + x] = dstp[width - 1 - x];
+    }
+}
+
+// IEEE half float conversions with the results of F16C, rounding to nearest even.
+static inline float halfToFloat(const uint16_t h) noexcept {
+    const uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+    const uint32_t exponent = (h >> 10) & 0x1F;
+    uint32_t mantissa = h & 0x3FF;
+    uint32_t f = sign;
+
+    if (exponent == 0x1F) {
+        // NaNs come out quiet.
+        f |= 0x7F800000 | (mantissa << 13) | (mantissa ? 0x400000 : 0);
+    } else if (exponent) {
+        f |= ((exponent + 112) << 23) | (mantissa << 13);
+    } else if (mantissa) {
+        // Subnormal halves are normal floats.
+        uint32_t e = 113;
+        while (!(mantissa & 0x400)) {
+            mantissa <<= 1;
+            e--;
+        }
+        f |= (e << 23) | ((mantissa & 0x3FF) << 13);
+    }
+
+    float v;
+    std::memcpy(&v, &f, sizeof(v));
+    return v;
+}
+
+static inline uint16_t floatToHalf(const float v) noexcept {
+    uint32_t f;
+    std::memcpy(&f, &v, sizeof(f));
+    const uint32_t sign = (f >> 16) & 0x8000;
+    f &= 0x7FFFFFFF;
+
+    if (f >= 0x47800000) {
+        // Infinity and overflow, or a quiet NaN with the upper bits of the payload.
+        return static_cast<uint16_t>(sign | ((f > 0x7F800000) ? 0x7E00 | ((f >> 13) & 0x3FF) : 0x7C00));
+    } else if (f < 0x38800000) {
+        // Below the smallest normal half, adding 0.5 lets the FPU round the mantissa into place.
+        float a;
+        std::memcpy(&a, &f, sizeof(a));
+        a += 0.5f;
+        std::memcpy(&f, &a, sizeof(f));
+        return static_cast<uint16_t>(sign | (f - 0x3F000000));
+    }
+
+    // Rebias the exponent and round the 13 dropped bits to nearest even; a carry correctly overflows to infinity.
+    f += (static_cast<uint32_t>(15 - 127) << 23) + 0xFFF + ((f >> 13) & 1);
+    return static_cast<uint16_t>(sign | (f >> 13));
+}
+
+// Converts a row of half floats to floats for the float kernel.
+static inline void pp7PadHalf(const void * _srcp, void * _dstp, const int width) noexcept {
+    const uint16_t * srcp = static_cast<const uint16_t *>(_srcp);
+    float * VS_RESTRICT dstp = static_cast<float *>(_dstp);
+
+    for (int x = 0; x < width; x++)
+        dstp[x] = halfToFloat(srcp[x]);
+    for (int x = 0; x < 8; x++) {
+        dstp[-1 - x] = dstp[x];
+        dstp[width + x] = dstp[width - 1 - x];
+    }
+}
+
+static inline void pp7StoreHalf(const float * srcp, void * _dstp, const int width) noexcept {
+    uint16_t * VS_RESTRICT dstp = static_cast<uint16_t *>(_dstp);
+
+    for (int x = 0; x < width; x++)
+        dstp[x] = floatToHalf(srcp[x]);
+}
+
+/*
+ * Stores a source row of type T in the output type O, shifted to the output depth.
+ */
+template<typename T, typename O>
+static void pp7Convert(const void * _srcp, void * _dstp, const int width, const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    const T * srcp = static_cast<const T *>(_srcp);
+    O * VS_RESTRICT dstp = static_cast<O *>(_dstp);
+
+    for (int x = 0; x < width; x++)
+        dstp[x] = static_cast<O>(srcp[x] << d->outShift);
+}
+
+template<>
+inline void pp7Convert<float, float>(const void * _srcp, void * _dstp, const int width, const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    std::memcpy(_dstp, _srcp, width * sizeof(float));
+}
+
+/*
+ * Merges a filtered row of the output type O with the source by a mask like std.MaskedMerge: the source where the mask
+ * is 0, the filtered row where it is at peak, and a rounded weighted mean in between. Source and mask are of type T.
+ */
+template<typename T, typename O>
+static void pp7Blend(const void * _srcp, const void * _maskp, void * _dstp, const int width, const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    const T * srcp = static_cast<const T *>(_srcp);
+    const T * maskp = static_cast<const T *>(_maskp);
+    O * VS_RESTRICT dstp = static_cast<O *>(_dstp);
+    const unsigned peak = d->peak;
+
+    for (int x = 0; x < width; x++) {
+        const unsigned m = std::min<unsigned>(maskp[x], peak);
+        dstp[x] = static_cast<O>(((peak - m) * (static_cast<unsigned>(srcp[x]) << d->outShift) + m * dstp[x] + peak / 2) / peak);
+    }
+}
+
+template<>
+inline void pp7Blend<float, float>(const void * _srcp, const void * _maskp, void * _dstp, const int width, const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    const float * srcp = static_cast<const float *>(_srcp);
+    const float * maskp = static_cast<const float *>(_maskp);
+    float * VS_RESTRICT dstp = static_cast<float *>(_dstp);
+
+    for (int x = 0; x < width; x++)
+        dstp[x] = srcp[x] + (dstp[x] - srcp[x]) * std::min(std::max(maskp[x], 0.f), 1.f);
+}
+
+static inline void pp7BlendHalf(const void * _srcp, const void * _maskp, void * _dstp, const int width, const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    const uint16_t * srcp = static_cast<const uint16_t *>(_srcp);
+    const uint16_t * maskp = static_cast<const uint16_t *>(_maskp);
+    uint16_t * VS_RESTRICT dstp = static_cast<uint16_t *>(_dstp);
+
+    for (int x = 0; x < width; x++) {
+        const float s = halfToFloat(srcp[x]);
+        dstp[x] = floatToHalf(s + (halfToFloat(dstp[x]) - s) * std::min(std::max(halfToFloat(maskp[x]), 0.f), 1.f));
+    }
+}
+
+/*
+ * Difference of the source of type T and a filtered row of the output type O like std.MakeDiff, offset by half the
+ * range for integer samples.
+ */
+template<typename T, typename O>
+static void pp7Residual(const void * _srcp, const void * _dstp, void * _resp, const int width, const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    const T * srcp = static_cast<const T *>(_srcp);
+    const O * dstp = static_cast<const O *>(_dstp);
+    O * VS_RESTRICT resp = static_cast<O *>(_resp);
+    const int peak = d->outPeak;
+
+    for (int x = 0; x < width; x++)
+        resp[x] = static_cast<O>(std::min(std::max((srcp[x] << d->outShift) - dstp[x] + (peak + 1) / 2, 0), peak));
+}
+
+template<>
+inline void pp7Residual<float, float>(const void * _srcp, const void * _dstp, void * _resp, const int width, const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    const float * srcp = static_cast<const float *>(_srcp);
+    const float * dstp = static_cast<const float *>(_dstp);
+    float * VS_RESTRICT resp = static_cast<float *>(_resp);
+
+    for (int x = 0; x < width; x++)
+        resp[x] = srcp[x] - dstp[x];
+}
+
+static inline void pp7ResidualHalf(const void * _srcp, const void * _dstp, void * _resp, const int width, const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    const uint16_t * srcp = static_cast<const uint16_t *>(_srcp);
+    const uint16_t * dstp = static_cast<const uint16_t *>(_dstp);
+    uint16_t * VS_RESTRICT resp = static_cast<uint16_t *>(_resp);
+
+    for (int x = 0; x < width; x++)
+        resp[x] = floatToHalf(halfToFloat(srcp[x]) - halfToFloat(dstp[x]));
+}
+
+/*
+ * Magnitude of a change of size a after limiting: changes up to d->limit - d->limitSoft are kept, and larger ones are
+ * eased quadratically into d->limit, which is reached at d->limit + d->limitSoft. limitKnee is 1 / (4 * limitSoft),
+ * or 0 for a hard limit.
+ */
+static inline float pp7Limited(const float a, const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    const float e = std::min(std::max(a - (d->limit - d->limitSoft), 0.f), 2.f * d->limitSoft);
+    return std::min(a - e * e * d->limitKnee, d->limit);
+}
+
+/*
+ * Limits the change of the integer kernel's output v against the source sample before it is rounded, like a
+ * LimitFilter after the filter. Changes up to d->limitKeep kernel units are kept exactly, the knee is evaluated in
+ * output units with d->limitUnit output units per kernel unit, and d->limitCap keeps the rounding from taking a change
+ * past d->limit.
+ */
+static inline int64_t pp7Limit(const int64_t v, const int source, const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    const int64_t base = static_cast<int64_t>(source) << 18;
+    const int64_t diff = v - base;
+    int64_t change = std::abs(diff);
+    if (change <= d->limitKeep)
+        return v;
+
+    change = std::min(static_cast<int64_t>(static_cast<double>(pp7Limited(change * d->limitUnit, d)) / d->limitUnit), d->limitCap);
+    return base + (diff < 0 ? -change : change);
+}
+
+static inline float pp7Limit(const float v, const float source, const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    const float diff = v - source;
+    const float change = pp7Limited(std::abs(diff), d);
+    return source + (diff < 0.f ? -change : change);
+}
+
+/*
+ * The integer kernel computes with 18 fractional bits, of which d->outShift are kept for an output deeper than the
+ * source. Float clips filtered in fixed point (d->fixed) come out of it as 16 bit samples and are stored as floats in
+ * [0, 1]. With limited, the output is limited against the source sample first.
+ */
+template<typename T, bool limited>
+static inline T pp7Round(int64_t v, const int source, const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    if (limited)
+        v = pp7Limit(v, source, d);
+
+    const int shift = 18 - d->outShift;
+    v = (v + (1 << (shift - 1))) >> shift;
+    if (std::is_floating_point<T>::value)
+        return std::min(std::max(v, int64_t{ 0 }), static_cast<int64_t>(d->outPeak)) * (1.f / 65535.f);
+
+    if (static_cast<uint64_t>(v) > d->outPeak)
+        v = (v < 0) ? 0 : d->outPeak;
+
+    return static_cast<T>(v);
+}
+
+template<typename T, bool limited>
+static inline T pp7Round(const float v, const float source, const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    const float out = v * ((1.f / (1 << 18)) * (1.f / 255.f));
+    return limited ? pp7Limit(out, source, d) : out;
+}
+
+/*
+ * Table-driven variant of the integer thresholding. lut[i][b] is the thresholded value of coefficient b for
+ * |b| <= lutLimit[i]; beyond that it grows with slope 1 in every mode, so clamping the index and adding back the
+ * clamped-off part gives the same result without branches.
+ *
+ * With reduced, the coefficients with the highest horizontal or vertical frequency (3, 7 and 11-15) are kept as they
+ * are instead of being thresholded.
+ *
+ * The thresholding functions write the output of the first count strengths to dstp[k]. The part of the sum that is not
+ * thresholded is shared. The number of outputs is also a template parameter so that the common case of a single qp has
+ * no loop over them; 0 stands for count.
+ */
+template<typename T, bool reduced, int outputs, bool limited>
+static inline void pp7ThresholdLut(const int * block, const int source, T * dstp, const int count, const DeblockPP7Table * const VS_RESTRICT t,
+                                   const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    int64_t base = static_cast<int64_t>(block[0]) * d->factor[0];
+    if (reduced) {
+        for (int i = 3; i < 16; i += (i < 11) ? 4 : 1)
+            base += static_cast<int64_t>(block[i]) * d->factor[i];
+    }
+
+    for (int k = 0; k < (outputs ? outputs : count); k++) {
+        const DeblockPP7Strength * s = t->strength + k;
+        int64_t v = base;
+        for (int i = 1; i < (reduced ? 11 : 16); i++) {
+            if (reduced && (i & 3) == 3)
+                continue;
+            const int limit = s->lutLimit[i];
+            const int j = std::min(std::max(block[i], -limit), limit);
+            v += static_cast<int64_t>(s->lut[i][j] + block[i] - j) * d->factor[i];
+        }
+        dstp[k] = pp7Round<T, limited>(v, source, d);
+    }
+}
+
+template<typename T, bool reduced, int outputs, bool limited>
+static inline void pp7Threshold(const int * block, const int source, T * dstp, const int count, const DeblockPP7Table * const VS_RESTRICT t,
+                                const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    if (t->strength[0].lut[1]) {
+        pp7ThresholdLut<T, reduced, outputs, limited>(block, source, dstp, count, t, d);
+        return;
+    }
+
+    int64_t base = static_cast<int64_t>(block[0]) * d->factor[0];
+    if (reduced) {
+        for (int i = 3; i < 16; i += (i < 11) ? 4 : 1)
+            base += static_cast<int64_t>(block[i]) * d->factor[i];
+    }
+
+    for (int k = 0; k < (outputs ? outputs : count); k++) {
+        const DeblockPP7Strength * s = t->strength + k;
+        int64_t v = base;
+        if (d->mode == 0) {
+            for (int i = 1; i < (reduced ? 11 : 16); i++) {
+                if (reduced && (i & 3) == 3)
+                    continue;
+                const unsigned threshold1 = s->thresh[i];
+                const unsigned threshold2 = threshold1 * 2;
+                if (block[i] + threshold1 > threshold2)
+                    v += static_cast<int64_t>(block[i]) * d->factor[i];
+            }
+        } else if (d->mode == 1) {
+            for (int i = 1; i < (reduced ? 11 : 16); i++) {
+                if (reduced && (i & 3) == 3)
+                    continue;
+                const unsigned threshold1 = s->thresh[i];
+                const unsigned threshold2 = threshold1 * 2;
+                if (block[i] + threshold1 > threshold2) {
+                    if (block[i] > 0)
+                        v += (block[i] - static_cast<int64_t>(threshold1)) * d->factor[i];
+                    else
+                        v += (block[i] + static_cast<int64_t>(threshold1)) * d->factor[i];
+                }
+            }
+        } else {
+            for (int i = 1; i < (reduced ? 11 : 16); i++) {
+                if (reduced && (i & 3) == 3)
+                    continue;
+                const unsigned threshold1 = s->thresh[i];
+                const unsigned threshold2 = threshold1 * 2;
+                if (block[i] + threshold1 > threshold2) {
+                    if (block[i] + threshold2 > threshold2 * 2) {
+                        v += static_cast<int64_t>(block[i]) * d->factor[i];
+                    } else {
+                        if (block[i] > 0)
+                            v += 2 * (block[i] - static_cast<int64_t>(threshold1)) * d->factor[i];
+                        else
+                            v += 2 * (block[i] + static_cast<int64_t>(threshold1)) * d->factor[i];
+                    }
+                }
+            }
+        }
+        dstp[k] = pp7Round<T, limited>(v, source, d);
+    }
+}
+
+template<typename T, bool reduced, int outputs, bool limited>
+static inline void pp7Threshold(const float * block, const float source, T * dstp, const int count, const DeblockPP7Table * const VS_RESTRICT t,
+                                const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    float base = block[0] * d->factor[0];
+    if (reduced) {
+        for (int i = 3; i < 16; i += (i < 11) ? 4 : 1)
+            base += block[i] * d->factor[i];
+    }
+
+    for (int k = 0; k < (outputs ? outputs : count); k++) {
+        const DeblockPP7Strength * s = t->strength + k;
+        float v = base;
+        if (d->mode == 0) {
+            for (int i = 1; i < (reduced ? 11 : 16); i++) {
+                if (reduced && (i & 3) == 3)
+                    continue;
+                const unsigned threshold1 = s->thresh[i];
+                const unsigned threshold2 = threshold1 * 2;
+                if (static_cast<unsigned>(block[i]) + threshold1 > threshold2)
+                    v += block[i] * d->factor[i];
+            }
+        } else if (d->mode == 1) {
+            for (int i = 1; i < (reduced ? 11 : 16); i++) {
+                if (reduced && (i & 3) == 3)
+                    continue;
+                const unsigned threshold1 = s->thresh[i];
+                const unsigned threshold2 = threshold1 * 2;
+                if (static_cast<unsigned>(block[i]) + threshold1 > threshold2) {
+                    if (block[i] > 0.f)
+                        v += (block[i] - threshold1) * d->factor[i];
+                    else
+                        v += (block[i] + threshold1) * d->factor[i];
+                }
+            }
+        } else {
+            for (int i = 1; i < (reduced ? 11 : 16); i++) {
+                if (reduced && (i & 3) == 3)
+                    continue;
+                const unsigned threshold1 = s->thresh[i];
+                const unsigned threshold2 = threshold1 * 2;
+                if (static_cast<unsigned>(block[i]) + threshold1 > threshold2) {
+                    if (static_cast<unsigned>(block[i]) + threshold2 > threshold2 * 2) {
+                        v += block[i] * d->factor[i];
+                    } else {
+                        if (block[i] > 0.f)
+                            v += 2.f * (block[i] - threshold1) * d->factor[i];
+                        else
+                            v += 2.f * (block[i] + threshold1) * d->factor[i];
+                    }
+                }
+            }
+        }
+        dstp[k] = pp7Round<T, limited>(v, source, d);
+    }
+}
+
+/*
+ * Output for a window where no AC coefficient can exceed its threshold. Only the DC term of dctB is computed, with the
+ * same operations as the full transform so that the result is identical. The float sum would be reassociated under
+ * -ffast-math, so float windows still take the DC term from dctB and skip the thresholding only.
+ */
+template<typename T, void (*dctB)(const int *, int *), bool limited>
+static inline T pp7Flat(const int * srcp, int *, const int source, const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    int s0 = srcp[0 * 4] + srcp[6 * 4];
+    const int s1 = srcp[1 * 4] + srcp[5 * 4];
+    const int s2 = srcp[2 * 4] + srcp[4 * 4];
+    const int s = srcp[3 * 4] + srcp[3 * 4];
+    s0 = s + s0;
+
+    return pp7Round<T, limited>(static_cast<int64_t>(s0 + (s2 + s1)) * d->factor[0], source, d);
+}
+
+template<typename T, void (*dctB)(const float *, float *), bool limited>
+static inline T pp7Flat(const float * srcp, float * block, const float source, const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    dctB(srcp, block);
+    return pp7Round<T, limited>(block[0] * d->factor[0], source, d);
+}
+
+static inline int flatRange(const int *, const DeblockPP7Table * const VS_RESTRICT t) noexcept {
+    return t->flatRange;
+}
+
+static inline float flatRange(const float *, const DeblockPP7Table * const VS_RESTRICT t) noexcept {
+    return t->flatRangeF;
+}
+
+static inline int flatRange(const int *, const DeblockPP7Strength * const VS_RESTRICT s) noexcept {
+    return s->flatRange;
+}
+
+static inline float flatRange(const float *, const DeblockPP7Strength * const VS_RESTRICT s) noexcept {
+    return s->flatRangeF;
+}
+
+/*
+ * Output for a pixel between two filtered ones at speed 2: its own sample plus the mean of the corrections the filter
+ * applied to its neighbours.
+ */
+template<typename T>
+static inline T pp7Interpolate(const int * srcp, const T * dstp, const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    const int shift = d->outShift;
+    const int v = (srcp[0] << shift) + ((dstp[-1] - (srcp[-1] << shift) + dstp[1] - (srcp[1] << shift) + 1) >> 1);
+    return static_cast<T>(std::min(std::max(v, 0), static_cast<int>(d->outPeak)));
+}
+
+template<>
+inline float pp7Interpolate<float>(const int * srcp, const float * dstp, const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    const float scale = 1.f / 65535.f;
+    return srcp[0] * scale + (dstp[-1] - srcp[-1] * scale + dstp[1] - srcp[1] * scale) * 0.5f;
+}
+
+template<typename T>
+static inline T pp7Interpolate(const float * srcp, const T * dstp, const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    return srcp[0] + (dstp[-1] - srcp[-1] + dstp[1] - srcp[1]) * 0.5f;
+}
+
+/*
+ * Merges a filtered row with the source row like std.Merge with the weight d->strength, which is d->weight / 32768 for
+ * integer samples.
+ */
+template<typename T, typename U>
+static inline void pp7Strength(const U * srcp, T * VS_RESTRICT dstp, const int width, const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    for (int x = 0; x < width; x++) {
+        const int source = srcp[x] << d->outShift;
+        dstp[x] = static_cast<T>(source + (((dstp[x] - source) * d->weight + (1 << 14)) >> 15));
+    }
+}
+
+static inline void pp7Strength(const float * srcp, float * VS_RESTRICT dstp, const int width, const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    for (int x = 0; x < width; x++)
+        dstp[x] = srcp[x] + (dstp[x] - srcp[x]) * d->strength;
+}
+
+static inline void pp7Strength(const int * srcp, float * VS_RESTRICT dstp, const int width, const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    const float scale = 1.f / 65535.f;
+    for (int x = 0; x < width; x++)
+        dstp[x] = srcp[x] * scale + (dstp[x] - srcp[x] * scale) * d->strength;
+}
+
+/*
+ * Horizontal transform and thresholding of pp7Row for pixels x0..x1-1 of a row of the given width, for a single qp
+ * (outputs = 1) or d->outputs of them (outputs = 0). centre is the widened source row the outputs are limited against.
+ */
+template<typename T, typename U, void (*dctB)(const U *, U *), int outputs, bool limited>
+static inline void pp7Columns(T * const * dstp, const U * VS_RESTRICT centre, const int x0, const int x1, const int width, U * VS_RESTRICT block,
+                              U * VS_RESTRICT temp, const U * VS_RESTRICT range, const DeblockPP7Table * const VS_RESTRICT t, const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    const int count = outputs ? outputs : d->outputs;
+    T * VS_RESTRICT out = dstp[0];
+    const U limit = flatRange(block, t);
+    const int step = (d->speed >= 2) ? 2 : 1;
+
+    for (int x = x0; x < x1; x++) {
+        U * VS_RESTRICT tp = temp + 4 * x;
+
+        if ((x & (step - 1)) && x != width - 1)
+            continue;
+
+        T v[OUTPUTS];
+
+        if (range[x] <= limit) {
+            v[0] = pp7Flat<T, dctB, limited>(tp, block, centre[x], d);
+            for (int k = 1; k < count; k++)
+                v[k] = v[0];
+        } else {
+            dctB(tp, block);
+
+            // The flat limit grows with qp, so the window is flat for all strengths from some point on.
+            int active = count;
+            while (outputs != 1 && range[x] <= flatRange(block, t->strength + active - 1))
+                active--;
+
+            if (d->speed)
+                pp7Threshold<T, true, outputs, limited>(block, centre[x], v, active, t, d);
+            else
+                pp7Threshold<T, false, outputs, limited>(block, centre[x], v, active, t, d);
+
+            if (active < count) {
+                v[active] = pp7Flat<T, dctB, limited>(tp, block, centre[x], d);
+                for (int k = active + 1; k < count; k++)
+                    v[k] = v[active];
+            }
+        }
+
+        // A single output is stored through a restricted pointer, so that its stores do not force the thresholds to be
+        // reloaded.
+        if (outputs == 1) {
+            out[x] = v[0];
+        } else {
+            for (int k = 0; k < count; k++)
+                dstp[t->strength[k].output][x] = v[k];
+        }
+    }
+}
+
+/*
+ * Filters one output row for every qp of the table t. rows[0..6] point to pixel 0 of the widened source rows y-3..y+3, each padded by
+ * 8 mirrored samples on both sides, and dstp[k] to the row of output k. dctA transforms 4 columns vertically into temp
+ * and records their minima and maxima in the same pass over the 7 rows, dctB transforms 7 columns of temp horizontally.
+ * The transform is shared by all outputs; only the thresholding is repeated per qp.
+ *
+ * Every AC basis function sums to zero, so an AC coefficient is bounded by half the range of its 7x7 window times the
+ * L1 norm of the basis function. Windows whose range is at most the flatRange of a qp thus produce the DC term only for
+ * that qp, and the thresholding is skipped for them. Below t->flatRange, the lowest limit of all qp values, dctB is
+ * skipped as well for integer samples.
+ *
+ * With a qp map, the row is thresholded in spans of one block each, so that the thresholds stay in registers within a
+ * block while the vertical transform and the ranges are still computed for the whole row at once.
+ *
+ * Every output sample is limited against the source before it is rounded, so that a soft limit does not round twice. At
+ * speed 2 the pixels in between take the mean of the limited corrections of their neighbours, which stays within the
+ * limit. Finally, every output row is merged with the source below full strength.
+ */
+template<typename T, typename U, void (*dctA)(const U * const *, const int, U *, U *, U *), void (*dctB)(const U *, U *)>
+static inline void pp7Row(const void * const * _rows, void * const * _dstp, const int width, void * buffer, const DeblockPP7Blocks * const VS_RESTRICT b,
+                          const DeblockPP7Data * const VS_RESTRICT d) noexcept {
+    const U * const * rows = reinterpret_cast<const U * const *>(_rows);
+    T * const * dstp = reinterpret_cast<T * const *>(_dstp);
+
+    U * VS_RESTRICT block = static_cast<U *>(buffer);
+    U * VS_RESTRICT temp = block + 16;
+    U * VS_RESTRICT lo = temp + 4 * (width + 16);
+    U * VS_RESTRICT hi = lo + width + 16;
+    U * VS_RESTRICT range = hi + width + 16;
+
+    for (int x = -8; x < width; x += 4)
+        dctA(rows, x + 5, temp + 4 * x + 4 * 8, lo + x + 8, hi + x + 8);
+
+    for (int x = 0; x < width; x++) {
+        U minimum = lo[x];
+        U maximum = hi[x];
+        for (int i = 1; i < 7; i++) {
+            minimum = std::min(minimum, lo[x + i]);
+            maximum = std::max(maximum, hi[x + i]);
+        }
+        range[x] = maximum - minimum;
+    }
+
+    for (int x0 = 0; x0 < width;) {
+        const DeblockPP7Table * t = b->table;
+        int x1 = width;
+
+        if (b->qp) {
+            const int column = (x0 + b->offset) >> b->shiftX;
+            x1 = std::min(((column + 1) << b->shiftX) - b->offset, width);
+            t = d->mapTable[std::min<int>(b->qp[std::min(column, b->columns - 1)], 63)].get();
+        }
+
+        if (d->limit < FLT_MAX) {
+            if (d->outputs == 1)
+                pp7Columns<T, U, dctB, 1, true>(dstp, rows[3], x0, x1, width, block, temp, range, t, d);
+            else
+                pp7Columns<T, U, dctB, 0, true>(dstp, rows[3], x0, x1, width, block, temp, range, t, d);
+        } else {
+            if (d->outputs == 1)
+                pp7Columns<T, U, dctB, 1, false>(dstp, rows[3], x0, x1, width, block, temp, range, t, d);
+            else
+                pp7Columns<T, U, dctB, 0, false>(dstp, rows[3], x0, x1, width, block, temp, range, t, d);
+        }
+
+        x0 = x1;
+    }
+
+    if (d->speed >= 2) {
+        for (int k = 0; k < d->outputs; k++) {
+            for (int x = 1; x < width - 1; x += 2)
+                dstp[k][x] = pp7Interpolate<T>(rows[3] + x, dstp[k] + x, d);
+        }
+    }
+
+    if (d->strength < 1.f) {
+        for (int k = 0; k < d->outputs; k++)
+            pp7Strength(rows[3], dstp[k], width, d);
+    }
+}
@@ -0,0 +1,35 @@
+#ifdef VS_TARGET_CPU_X86
+// This unit is compiled with F16C, which implies AVX encodings, so it does not include DeblockPP7.hpp: an inline
+// function instantiated here could otherwise be picked by the linker for the other units and run on CPUs without AVX.
+#include <immintrin.h>
+
+#include <cstdint>
+
+// Converts a row of half floats to floats and mirrors 8 samples at both ends, like pp7Pad.
+void pp7PadHalf_f16c(const void * _srcp, void * _dstp, const int width) noexcept {
+    const uint16_t * srcp = static_cast<const uint16_t *>(_srcp);
+    float * dstp = static_cast<float *>(_dstp);
+
+    int x = 0;
+    for (; x + 4 <= width; x += 4)
+        _mm_storeu_ps(dstp + x, _mm_cvtph_ps(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(srcp + x))));
+    for (; x < width; x++)
+        dstp[x] = _cvtsh_ss(srcp[x]);
+
+    for (x = 0; x < 8; x++) {
+        dstp[-1 - x] = dstp[x];
+        dstp[width + x] = dstp[width - 1 - x];
+    }
+}
+
+// Rounds a row of floats to half floats to nearest even.
+void pp7StoreHalf_f16c(const float * srcp, void * _dstp, const int width) noexcept {
+    uint16_t * dstp = static_cast<uint16_t *>(_dstp);
+
+    int x = 0;
+    for (; x + 4 <= width; x += 4)
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(dstp + x), _mm_cvtps_ph(_mm_loadu_ps(srcp + x), _MM_FROUND_TO_NEAREST_INT));
+    for (; x < width; x++)
+        dstp[x] = _cvtss_sh(srcp[x], _MM_FROUND_TO_NEAREST_INT);
+}
+#endif
@@ -0,0 +1,79 @@
+"""
+Every output of a filter with several qp values or residual must be the same as a filter with just that output, also when
+the outputs are requested out of order from many threads at once.
+
+Run with the plugin loaded by VapourSynth: python tests/test_concurrency.py
+"""
+
+import random
+import unittest
+from concurrent.futures import ThreadPoolExecutor
+
+import vapoursynth as vs
+
+core = vs.get_core()
+core.num_threads = 8
+
+WIDTH = 64
+HEIGHT = 48
+LENGTH = 60
+
+
+def noise(seed):
+    """A gray clip with random pixels, different in every frame."""
+
+    blank = core.std.BlankClip(format=vs.GRAY8, width=WIDTH, height=HEIGHT, length=LENGTH)
+
+    def modify(n, f):
+        fout = f.copy()
+        rng = random.Random(seed * 1000 + n)
+        array = fout.get_write_array(0)
+        for y in range(fout.height):
+            for x in range(fout.width):
+                array[y, x] = rng.randrange(256)
+        return fout
+
+    return core.std.ModifyFrame(blank, blank, modify)
+
+
+def pixels(frame):
+    return bytes(frame.get_read_array(0))
+
+
+class ConcurrencyTest(unittest.TestCase):
+    def check(self, qp, residual, **args):
+        clip = noise(1)
+        outputs = core.pp7.DeblockPP7(clip, qp=qp, residual=residual, **args)
+
+        references = [core.pp7.DeblockPP7(clip, qp=q, **args) for q in qp]
+        if residual:
+            references += [core.std.MakeDiff(clip, reference) for reference in references]
+        self.assertEqual(len(outputs), len(references))
+
+        requests = [(n, index) for n in range(LENGTH) for index in range(len(outputs))]
+        random.Random(2).shuffle(requests)
+
+        def get(request):
+            n, index = request
+            return pixels(outputs[index].get_frame(n))
+
+        with ThreadPoolExecutor(max_workers=16) as executor:
+            results = list(executor.map(get, requests))
+
+        for (n, index), result in zip(requests, results):
+            expected = pixels(references[index].get_frame(n))
+            self.assertEqual(result, expected, 'frame {} output {} with qp={} residual={} {}'.format(n, index, qp, residual, args))
+
+    def test_outputs(self):
+        self.check([2.0, 8.0], False)
+        self.check([2.0, 8.0], True)
+        self.check([2.0, 4.0, 8.0], False)
+
+    def test_batch(self):
+        self.check([2.0, 8.0], False, batch=1)
+        self.check([2.0, 8.0], True, batch=4)
+        self.check([4.0], True, batch=4)
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,63 @@
+"""
+Pixels where the mask is 0 must be exact copies of the source, also for float clips where an unwritten output sample
+could be NaN.
+
+Run with the plugin loaded by VapourSynth: python tests/test_mask.py
+"""
+
+import random
+import unittest
+
+import vapoursynth as vs
+
+core = vs.get_core()
+
+WIDTH = 160
+HEIGHT = 96
+
+
+def fill(clip, seed, value):
+    """Writes value(rng, x, y) to every pixel of every frame of a gray clip."""
+
+    def modify(n, f):
+        fout = f.copy()
+        rng = random.Random(seed * 1000 + n)
+        array = fout.get_write_array(0)
+        for y in range(fout.height):
+            for x in range(fout.width):
+                array[y, x] = value(rng, x, y)
+        return fout
+
+    return core.std.ModifyFrame(clip, clip, modify)
+
+
+class MaskTest(unittest.TestCase):
+    def check(self, fmt, **args):
+        blank = core.std.BlankClip(format=fmt, width=WIDTH, height=HEIGHT, length=2)
+        clip = fill(blank, 1, lambda rng, x, y: rng.random())
+        # 1 in a single 8x8 area and 0 everywhere else.
+        mask = fill(blank, 2, lambda rng, x, y: 1.0 if 40 <= x < 48 and 24 <= y < 32 else 0.0)
+
+        out = core.pp7.DeblockPP7(clip, mask=mask, **args)
+
+        for n in range(clip.num_frames):
+            src = clip.get_frame(n).get_read_array(0)
+            dst = out.get_frame(n).get_read_array(0)
+            msk = mask.get_frame(n).get_read_array(0)
+            for y in range(HEIGHT):
+                for x in range(WIDTH):
+                    if msk[y, x] == 0:
+                        self.assertEqual(dst[y, x], src[y, x], 'frame {} pixel ({}, {}) with {}'.format(n, x, y, args))
+
+    def test_float(self):
+        self.check(vs.GRAYS)
+        self.check(vs.GRAYS, speed=2)
+        self.check(vs.GRAYS, qp=[2.0, 8.0])
+
+    def test_half(self):
+        self.check(vs.GRAYH)
+        self.check(vs.GRAYH, speed=2, opt=1)
+
+
+if __name__ == '__main__':
+    unittest.main()